@@ -12,6 +12,10 @@
   This ensures the client reference in the callback function
   is valid.
 
+  The client is given separate buffers for receiving and
+  sending, so the payload can be republished straight from
+  where it was received.
+
 */
 
 #include <SPI.h>
@@ -31,22 +35,18 @@ PubSubClient client(server, 1883, callback, ethClient);
 
 // Callback function
 void callback(char* topic, byte* payload, unsigned int length) {
-  // In order to republish this payload, a copy must be made
-  // as the orignal payload buffer will be overwritten whilst
-  // constructing the PUBLISH packet.
-
-  // Allocate the correct amount of memory for the payload copy
-  byte* p = (byte*)malloc(length);
-  // Copy the payload to the new buffer
-  memcpy(p,payload,length);
-  client.publish("outTopic", p, length);
-  // Free the memory
-  free(p);
+  // The PUBLISH packet is built in the send buffer, so the
+  // payload is left alone while it is republished.
+  client.publish("outTopic", payload, length);
 }
 
 void setup()
 {
 
+  // Without its own send buffer, the client builds the PUBLISH
+  // packet over the payload, which would have to be copied first
+  client.setBufferSize(MQTT_MAX_PACKET_SIZE, MQTT_MAX_PACKET_SIZE);
+
   Ethernet.begin(mac, ip);
   if (client.connect("arduinoClient")) {
     client.publish("outTopic","hello world");
@@ -2,9 +2,12 @@
  Reconnecting MQTT example - non-blocking
 
  This sketch demonstrates how to keep the client connected
- using a non-blocking reconnect function. If the client loses
- its connection, it attempts to reconnect every 5 seconds
- without blocking the main loop.
+ without blocking the main loop. If the client loses its
+ connection, loop() reconnects with the same client id. The
+ wait between attempts is random, up to a limit that starts
+ at 1 second and doubles after each failure up to 1 minute,
+ so devices that lose the same server do not all return to
+ it at once.
 
 */
 
@@ -24,44 +27,31 @@ void callback(char* topic, byte* payload, unsigned int length) {
 EthernetClient ethClient;
 PubSubClient client(ethClient);
 
-long lastReconnectAttempt = 0;
-
-boolean reconnect() {
-  if (client.connect("arduinoClient")) {
+void connected(int state) {
+  if (state == MQTT_CONNECTED) {
     // Once connected, publish an announcement...
     client.publish("outTopic","hello world");
     // ... and resubscribe
     client.subscribe("inTopic");
   }
-  return client.connected();
 }
 
 void setup()
 {
   client.setServer(server, 1883);
   client.setCallback(callback);
+  client.setConnectCallback(connected);
+  // Keep trying for as long as it takes
+  client.setReconnect(1000, 60000, 0);
 
   Ethernet.begin(mac, ip);
   delay(1500);
-  lastReconnectAttempt = 0;
+  client.connectAsync("arduinoClient");
 }
 
 
 void loop()
 {
-  if (!client.connected()) {
-    long now = millis();
-    if (now - lastReconnectAttempt > 5000) {
-      lastReconnectAttempt = now;
-      // Attempt to reconnect
-      if (reconnect()) {
-        lastReconnectAttempt = 0;
-      }
-    }
-  } else {
-    // Client connected
-
-    client.loop();
-  }
-
+  // Handles messages while connected, and reconnecting while not
+  client.loop();
 }
@@ -0,0 +1,22 @@
+/*
+ Arduino.cpp - The parts of the Arduino core that PubSubClient uses, so it can
+ be built on Linux and other POSIX systems.
+*/
+
+#include "Arduino.h"
+#include <time.h>
+#include <unistd.h>
+
+unsigned long millis(void) {
+    static struct timespec start;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    if (start.tv_sec == 0 && start.tv_nsec == 0) {
+        start = now;
+    }
+    return (unsigned long)((now.tv_sec-start.tv_sec)*1000+(now.tv_nsec-start.tv_nsec)/1000000);
+}
+
+void yield(void) {
+    usleep(1000);
+}
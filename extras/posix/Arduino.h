@@ -0,0 +1,30 @@
+/*
+ Arduino.h - The parts of the Arduino core that PubSubClient uses, so it can
+ be built on Linux and other POSIX systems.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+// Milliseconds since the first call, from a clock that is not changed by
+// setting the time of day
+unsigned long millis(void);
+// Sleeps for a millisecond, so connect() does not spin while it waits for the
+// server
+void yield(void);
+
+// Everything is in RAM
+#define PROGMEM
+#define pgm_read_byte_near(addr) (*(const uint8_t*)(addr))
+
+#include "Print.h"
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ IPAddress.cpp - An IPv4 address, as in the Arduino core, for PubSubClient on
+ Linux and other POSIX systems.
+*/
+
+#include "IPAddress.h"
+#include <string.h>
+
+IPAddress::IPAddress() {
+    memset(this->address,0,4);
+}
+
+IPAddress::IPAddress(uint8_t first, uint8_t second, uint8_t third, uint8_t fourth) {
+    this->address[0] = first;
+    this->address[1] = second;
+    this->address[2] = third;
+    this->address[3] = fourth;
+}
+
+IPAddress::IPAddress(uint32_t address) {
+    memcpy(this->address,&address,4);
+}
+
+IPAddress::IPAddress(const uint8_t *address) {
+    memcpy(this->address,address,4);
+}
+
+IPAddress::operator uint32_t() const {
+    uint32_t a;
+    memcpy(&a,this->address,4);
+    return a;
+}
+
+bool IPAddress::operator==(const IPAddress& other) const {
+    return memcmp(this->address,other.address,4) == 0;
+}
@@ -0,0 +1,26 @@
+/*
+ IPAddress.h - An IPv4 address, as in the Arduino core, for PubSubClient on
+ Linux and other POSIX systems.
+*/
+
+#ifndef IPAddress_h
+#define IPAddress_h
+
+#include <stdint.h>
+
+class IPAddress {
+private:
+   uint8_t address[4];
+public:
+   IPAddress();
+   IPAddress(uint8_t first, uint8_t second, uint8_t third, uint8_t fourth);
+   // The address as it is held in memory, first octet first
+   IPAddress(uint32_t address);
+   IPAddress(const uint8_t *address);
+   operator uint32_t() const;
+   bool operator==(const IPAddress& other) const;
+   uint8_t operator[](int index) const { return address[index]; }
+   uint8_t& operator[](int index) { return address[index]; }
+};
+
+#endif
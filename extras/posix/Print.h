@@ -0,0 +1,31 @@
+/*
+ Print.h - The parts of the Arduino Print class that PubSubClient uses.
+*/
+
+#ifndef Print_h
+#define Print_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+class Print {
+public:
+   virtual ~Print() {}
+   virtual size_t write(uint8_t) = 0;
+   virtual size_t write(const uint8_t *buffer, size_t size) {
+       size_t n = 0;
+       while (size--) {
+           n += write(*buffer++);
+       }
+       return n;
+   }
+   size_t write(const char *str) {
+       return (str == NULL)?0:write((const uint8_t*)str,strlen(str));
+   }
+   size_t print(const char *str) {
+       return write(str);
+   }
+};
+
+#endif
@@ -0,0 +1,18 @@
+/*
+ Stream.h - The Arduino Stream class, for PubSubClient on Linux and other POSIX
+ systems.
+*/
+
+#ifndef Stream_h
+#define Stream_h
+
+#include "Print.h"
+
+class Stream : public Print {
+public:
+   virtual int available() = 0;
+   virtual int read() = 0;
+   virtual int peek() = 0;
+};
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ Basic MQTT example for Linux and other POSIX systems
+
+  - connects to the MQTT server given on the command line
+  - publishes "hello world" to the topic "outTopic"
+  - subscribes to the topic "inTopic", printing any messages received
+  - reconnects if the connection is lost
+  - sleeps in poll() until the socket is ready or there is something to
+    do, rather than calling loop() over and over
+
+  Build it with make in extras/posix, then run
+    build/mqtt_posix <server> [port]
+*/
+
+#include <poll.h>
+#include <stdio.h>
+#include "PubSubClient.h"
+#include "PosixClient.h"
+
+PosixClient posixClient;
+PubSubClient client(posixClient);
+
+void callback(char* topic, byte* payload, unsigned int length) {
+  printf("Message arrived [%s] %.*s\n", topic, (int)length, (char*)payload);
+}
+
+void connected(int state) {
+  if (state == MQTT_CONNECTED) {
+    client.publish("outTopic", "hello world");
+    client.subscribe("inTopic");
+  } else {
+    printf("Connect failed, state %d\n", state);
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <server> [port]\n", argv[0]);
+    return 1;
+  }
+  client.setServer(argv[1], (argc > 2) ? atoi(argv[2]) : 1883);
+  client.setCallback(callback);
+  client.setConnectCallback(connected);
+  client.setReconnect(1000, 60000, 0);
+  client.connectAsync("posixClient");
+
+  while (true) {
+    struct pollfd p;
+    p.fd = client.getFd();
+    p.events = (client.wantsRead() ? POLLIN : 0) | (client.wantsWrite() ? POLLOUT : 0);
+    p.revents = 0;
+    uint32_t timeout = client.millisUntilTimer();
+    poll(&p, (p.fd >= 0) ? 1 : 0, (timeout == MQTT_RECONNECT_NEVER) ? -1 : (int)timeout);
+    if (p.revents & (POLLIN | POLLHUP | POLLERR)) {
+      client.onReadable();
+    }
+    if (p.revents & POLLOUT) {
+      client.onWritable();
+    }
+    client.onTimer();
+  }
+}
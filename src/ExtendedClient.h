@@ -0,0 +1,25 @@
+/*
+ ExtendedClient.h - Optional capabilities a network Client can offer to
+ PubSubClient.
+*/
+
+#ifndef ExtendedClient_h
+#define ExtendedClient_h
+
+#include <Arduino.h>
+#include "Client.h"
+
+// A Client that can do more than the standard Arduino Client api.
+// Pass it to PubSubClient::setClient() so the extra calls are used.
+class ExtendedClient : public Client {
+public:
+   // Write count buffers, one after the other, in a single call - for example
+   // with writev() on a POSIX socket.
+   // Returns the total number of bytes written
+   virtual size_t writev(const uint8_t* const* buffers, const size_t* lengths, uint8_t count) = 0;
+   // The file descriptor, or other handle, an event loop can wait on for the
+   // connection to become readable or writable. -1 if there is none
+   virtual int fd() { return -1; }
+};
+
+#endif
@@ -0,0 +1,24 @@
+/*
+ MQTTAllocator.h - Where PubSubClient gets the memory for its buffers.
+*/
+
+#ifndef MQTTAllocator_h
+#define MQTTAllocator_h
+
+#include <Arduino.h>
+
+// Memory for the buffers PubSubClient allocates - the packet buffer, the
+// inflight messages, the outbound buffer, the offline queue, the topic filters
+// of handlers, MQTT 5 topic aliases and TopicHandles from topic(). Pass one to
+// PubSubClient::setAllocator() to place them in, for example, external PSRAM
+// or a static arena. Without one, malloc() and free() are used.
+class MQTTAllocator {
+public:
+   virtual ~MQTTAllocator() {}
+   // Returns size bytes of memory, or NULL if there are not enough
+   virtual void* allocate(size_t size) = 0;
+   // Gives back memory returned by allocate()
+   virtual void release(void* ptr) = 0;
+};
+
+#endif
@@ -0,0 +1,197 @@
+/*
+ MQTTFileStore.cpp - An MQTTStore kept in a file, for PubSubClient on Linux and
+ other POSIX systems.
+*/
+
+#include "MQTTFileStore.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+// Each entry in the log is an op, the message id and the length of the packet
+// that follows - which is empty for a remove
+#define MQTT_LOG_PUT      'P'
+#define MQTT_LOG_REMOVE   'R'
+#define MQTT_LOG_HEADER   5
+
+MQTTFileStore::MQTTFileStore(const char* path, uint16_t size, boolean sync) : MQTTMemoryStore(size) {
+    this->path = strdup(path);
+    this->fd = -1;
+    this->logSize = 0;
+    this->sync = sync;
+}
+
+MQTTFileStore::~MQTTFileStore() {
+    if (this->fd >= 0) {
+        close(this->fd);
+    }
+    free(this->path);
+}
+
+boolean MQTTFileStore::begin() {
+    if (this->path == NULL || this->records == NULL) {
+        return false;
+    }
+    if (this->fd >= 0) {
+        close(this->fd);
+    }
+    this->used = 0;
+    this->fd = open(this->path, O_RDWR | O_CREAT, 0644);
+    if (this->fd < 0) {
+        return false;
+    }
+    // Replay the log into memory. A packet never needs more than size bytes,
+    // so that is enough to read each one into
+    uint8_t* packet = (uint8_t*)malloc(this->size);
+    if (packet == NULL) {
+        return false;
+    }
+    boolean rc = true;
+    uint8_t header[MQTT_LOG_HEADER];
+    while (read(this->fd,header,MQTT_LOG_HEADER) == MQTT_LOG_HEADER) {
+        uint16_t msgId = (header[1]<<8)+header[2];
+        uint16_t length = (header[3]<<8)+header[4];
+        if (header[0] == MQTT_LOG_PUT) {
+            if (length > this->size || read(this->fd,packet,length) != length) {
+                // Cut short by a crash while it was being written
+                break;
+            }
+            if (!MQTTMemoryStore::put(msgId,packet,length)) {
+                rc = false;
+                break;
+            }
+        } else if (header[0] == MQTT_LOG_REMOVE) {
+            MQTTMemoryStore::remove(msgId);
+        } else {
+            break;
+        }
+    }
+    free(packet);
+    // Start again with a log of only what is still stored, which also drops
+    // anything left half written
+    return compact() && rc;
+}
+
+boolean MQTTFileStore::put(uint16_t msgId, const uint8_t* packet, uint16_t length) {
+    // Logged first, so a packet that would not be there after a restart is
+    // never held, and one it replaces is kept
+    if (!fits(msgId,length) || !append(MQTT_LOG_PUT,msgId,packet,length)) {
+        return false;
+    }
+    return MQTTMemoryStore::put(msgId,packet,length);
+}
+
+boolean MQTTFileStore::remove(uint16_t msgId) {
+    if (!MQTTMemoryStore::remove(msgId)) {
+        return false;
+    }
+    if (this->used == 0 && this->fd >= 0) {
+        // Everything has been acknowledged
+        if (ftruncate(this->fd,0) == 0) {
+            lseek(this->fd,0,SEEK_SET);
+            this->logSize = 0;
+            if (this->sync) {
+                fsync(this->fd);
+            }
+            return true;
+        }
+    }
+    if (!append(MQTT_LOG_REMOVE,msgId,NULL,0)) {
+        return false;
+    }
+    if (this->logSize > 2*(uint32_t)this->size) {
+        // Mostly packets that have since been removed
+        compact();
+    }
+    return true;
+}
+
+// Adds an entry to the end of the log
+boolean MQTTFileStore::append(uint8_t op, uint16_t msgId, const uint8_t* packet, uint16_t length) {
+    if (this->fd < 0) {
+        return false;
+    }
+    uint8_t header[MQTT_LOG_HEADER];
+    header[0] = op;
+    header[1] = (msgId >> 8);
+    header[2] = (msgId & 0xFF);
+    header[3] = (length >> 8);
+    header[4] = (length & 0xFF);
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = MQTT_LOG_HEADER;
+    iov[1].iov_base = (void*)packet;
+    iov[1].iov_len = length;
+    ssize_t rc = writev(this->fd,iov,(length > 0)?2:1);
+    if (rc != (ssize_t)(MQTT_LOG_HEADER+length)) {
+        // Don't leave part of an entry behind
+        if (ftruncate(this->fd,this->logSize) == 0) {
+            lseek(this->fd,this->logSize,SEEK_SET);
+        }
+        return false;
+    }
+    this->logSize += rc;
+    if (this->sync) {
+        fsync(this->fd);
+    }
+    return true;
+}
+
+// Replaces the log with one holding only the packets still stored. The new log
+// is written alongside the old one and renamed over it, so one of them is
+// always complete
+boolean MQTTFileStore::compact() {
+    size_t plen = strlen(this->path);
+    char* tmp = (char*)malloc(plen+5);
+    if (tmp == NULL) {
+        return false;
+    }
+    memcpy(tmp,this->path,plen);
+    memcpy(tmp+plen,".tmp",5);
+    int newFd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (newFd < 0) {
+        free(tmp);
+        return false;
+    }
+    int oldFd = this->fd;
+    this->fd = newFd;
+    this->logSize = 0;
+    uint16_t msgId;
+    uint16_t length;
+    uint8_t* packet;
+    boolean rc = true;
+    // The whole file is flushed once it is written
+    boolean wasSync = this->sync;
+    this->sync = false;
+    for (uint16_t i = 0; (packet = item(i,&msgId,&length)) != NULL; i++) {
+        if (!append(MQTT_LOG_PUT,msgId,packet,length)) {
+            rc = false;
+            break;
+        }
+    }
+    this->sync = wasSync;
+    if (rc && fsync(newFd) == 0 && rename(tmp,this->path) == 0) {
+        if (oldFd >= 0) {
+            close(oldFd);
+        }
+    } else {
+        // Carry on with the old log
+        close(newFd);
+        unlink(tmp);
+        this->fd = oldFd;
+        this->logSize = (oldFd >= 0)?lseek(oldFd,0,SEEK_END):0;
+        rc = false;
+    }
+    free(tmp);
+    return rc;
+}
+
+uint32_t MQTTFileStore::getLogSize() {
+    return this->logSize;
+}
+
+#endif
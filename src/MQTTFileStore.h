@@ -0,0 +1,45 @@
+/*
+ MQTTFileStore.h - An MQTTStore kept in a file, for PubSubClient on Linux and
+ other POSIX systems.
+*/
+
+#ifndef MQTTFileStore_h
+#define MQTTFileStore_h
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include "MQTTStore.h"
+
+// An MQTTStore that survives the process, or the machine, restarting.
+//
+// The packets are held in RAM, as in MQTTMemoryStore, and every change is also
+// appended to a log file. begin() reads the log back. Once everything in the
+// log has been acknowledged the file is emptied, and when acknowledged packets
+// make up most of it the log is rewritten with only the packets still stored.
+//
+// Appends reach the operating system straight away, which is enough to survive
+// the process restarting. Pass sync as true to also flush them to the disk
+// before put() and remove() return, so they survive a power cut.
+class MQTTFileStore : public MQTTMemoryStore {
+private:
+   char* path;
+   int fd;
+   uint32_t logSize;
+   boolean sync;
+   boolean append(uint8_t op, uint16_t msgId, const uint8_t* packet, uint16_t length);
+   boolean compact();
+public:
+   MQTTFileStore(const char* path, uint16_t size, boolean sync = false);
+   virtual ~MQTTFileStore();
+   // Opens the log, loading any packets left in it. Returns false if it cannot
+   // be opened, or holds more than fits in size bytes
+   boolean begin();
+   virtual boolean put(uint16_t msgId, const uint8_t* packet, uint16_t length);
+   virtual boolean remove(uint16_t msgId);
+   // The size of the log file, in bytes
+   uint32_t getLogSize();
+};
+
+#endif
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ MQTTStore.cpp - Storage for the messages PubSubClient is waiting to have
+ acknowledged, so they can outlive the client.
+*/
+
+#include "MQTTStore.h"
+
+MQTTMemoryStore::MQTTMemoryStore(uint16_t size) {
+    this->records = (uint8_t*)malloc(size);
+    this->size = (this->records != NULL)?size:0;
+    this->used = 0;
+}
+
+MQTTMemoryStore::~MQTTMemoryStore() {
+    free(this->records);
+}
+
+// Returns the offset of the record for msgId, or -1 if there is none
+int32_t MQTTMemoryStore::find(uint16_t msgId) {
+    uint16_t offset = 0;
+    while (offset < this->used) {
+        uint8_t* record = this->records+offset;
+        if ((record[0]<<8)+record[1] == msgId) {
+            return offset;
+        }
+        offset += 4+(record[2]<<8)+record[3];
+    }
+    return -1;
+}
+
+boolean MQTTMemoryStore::fits(uint16_t msgId, uint16_t length) {
+    int32_t offset = find(msgId);
+    uint16_t available = this->size-this->used;
+    if (offset >= 0) {
+        // The old record is replaced
+        available += 4+(this->records[offset+2]<<8)+this->records[offset+3];
+    }
+    return 4+(uint32_t)length <= available;
+}
+
+boolean MQTTMemoryStore::put(uint16_t msgId, const uint8_t* packet, uint16_t length) {
+    if (!fits(msgId,length)) {
+        return false;
+    }
+    MQTTMemoryStore::remove(msgId);
+    uint8_t* record = this->records+this->used;
+    record[0] = (msgId >> 8);
+    record[1] = (msgId & 0xFF);
+    record[2] = (length >> 8);
+    record[3] = (length & 0xFF);
+    memcpy(record+4,packet,length);
+    this->used += 4+length;
+    return true;
+}
+
+uint8_t* MQTTMemoryStore::get(uint16_t msgId, uint16_t* length) {
+    int32_t offset = find(msgId);
+    if (offset < 0) {
+        return NULL;
+    }
+    uint8_t* record = this->records+offset;
+    *length = (record[2]<<8)+record[3];
+    return record+4;
+}
+
+boolean MQTTMemoryStore::remove(uint16_t msgId) {
+    int32_t offset = find(msgId);
+    if (offset < 0) {
+        return false;
+    }
+    // Close the gap, so the records stay in the order they were stored
+    uint16_t length = 4+(this->records[offset+2]<<8)+this->records[offset+3];
+    memmove(this->records+offset,this->records+offset+length,this->used-offset-length);
+    this->used -= length;
+    return true;
+}
+
+uint8_t* MQTTMemoryStore::item(uint16_t index, uint16_t* msgId, uint16_t* length) {
+    uint16_t offset = 0;
+    while (offset < this->used) {
+        uint8_t* record = this->records+offset;
+        uint16_t l = (record[2]<<8)+record[3];
+        if (index == 0) {
+            *msgId = (record[0]<<8)+record[1];
+            *length = l;
+            return record+4;
+        }
+        index--;
+        offset += 4+l;
+    }
+    return NULL;
+}
+
+uint16_t MQTTMemoryStore::getUsed() {
+    return this->used;
+}
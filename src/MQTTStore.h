@@ -0,0 +1,57 @@
+/*
+ MQTTStore.h - Storage for the messages PubSubClient is waiting to have
+ acknowledged, so they can outlive the client.
+*/
+
+#ifndef MQTTStore_h
+#define MQTTStore_h
+
+#include <Arduino.h>
+
+// Somewhere to keep the QoS 1 and QoS 2 packets that have been sent but not yet
+// acknowledged. Pass one to PubSubClient::setStore(); anything left in it when
+// the client next connects is sent again.
+//
+// Packets are stored exactly as they are sent - a PUBLISH, or the PUBREL that
+// replaces it once the server has sent its PUBREC - under their message id.
+// The pointers returned by get() and item() point into the store's own memory,
+// so the packets can be sent from there without being copied. They remain valid
+// until the next put() or remove().
+class MQTTStore {
+public:
+   virtual ~MQTTStore() {}
+   // Keeps a copy of packet, replacing anything already stored under msgId.
+   // Returns false if it cannot be stored
+   virtual boolean put(uint16_t msgId, const uint8_t* packet, uint16_t length) = 0;
+   // Returns the packet stored under msgId, or NULL if there is none
+   virtual uint8_t* get(uint16_t msgId, uint16_t* length) = 0;
+   // Forgets the packet stored under msgId
+   virtual boolean remove(uint16_t msgId) = 0;
+   // Returns the index'th stored packet, oldest first, or NULL past the end
+   virtual uint8_t* item(uint16_t index, uint16_t* msgId, uint16_t* length) = 0;
+};
+
+// An MQTTStore held in RAM. It survives the client being deleted and created
+// again, but not a restart.
+// Each packet is held as its message id, its length and then the packet itself,
+// one after the other, with no gaps.
+class MQTTMemoryStore : public MQTTStore {
+protected:
+   uint8_t* records;
+   uint16_t size;
+   uint16_t used;
+   int32_t find(uint16_t msgId);
+   // Whether put() has room for a packet of length bytes under msgId
+   boolean fits(uint16_t msgId, uint16_t length);
+public:
+   explicit MQTTMemoryStore(uint16_t size);
+   virtual ~MQTTMemoryStore();
+   virtual boolean put(uint16_t msgId, const uint8_t* packet, uint16_t length);
+   virtual uint8_t* get(uint16_t msgId, uint16_t* length);
+   virtual boolean remove(uint16_t msgId);
+   virtual uint8_t* item(uint16_t index, uint16_t* msgId, uint16_t* length);
+   // The number of bytes in use, including the 4 byte record headers
+   uint16_t getUsed();
+};
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ PosixClient.cpp - A Client for PubSubClient on Linux and other POSIX systems,
+ over a non-blocking TCP socket.
+*/
+
+#include "PosixClient.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// A write to a socket the server has closed fails with EPIPE, rather than
+// raising SIGPIPE and ending the process. Where send() has no flag for this,
+// the socket is set up with SO_NOSIGPIPE instead
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// How many buffers writev() passes to the socket in each call
+#define POSIX_CLIENT_IOV_MAX 8
+
+PosixClient::PosixClient() {
+    this->sock = -1;
+}
+
+PosixClient::~PosixClient() {
+    stop();
+}
+
+int PosixClient::connect(IPAddress ip, uint16_t port) {
+    struct sockaddr_in addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(((uint32_t)ip[0]<<24)|((uint32_t)ip[1]<<16)|((uint32_t)ip[2]<<8)|ip[3]);
+    return open((struct sockaddr*)&addr,sizeof(addr));
+}
+
+int PosixClient::connect(const char *host, uint16_t port) {
+    char service[6];
+    snprintf(service,sizeof(service),"%u",port);
+    struct addrinfo hints;
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* addrs;
+    if (getaddrinfo(host,service,&hints,&addrs) != 0) {
+        return 0;
+    }
+    boolean rc = false;
+    for (struct addrinfo* a = addrs; a != NULL && !rc; a = a->ai_next) {
+        rc = open(a->ai_addr,a->ai_addrlen);
+    }
+    freeaddrinfo(addrs);
+    return rc;
+}
+
+// Opens a socket and connects it to addr, waiting no longer than
+// POSIX_CLIENT_CONNECT_TIMEOUT
+boolean PosixClient::open(const struct sockaddr* addr, uint32_t addrLength) {
+    stop();
+    int s = socket(addr->sa_family,SOCK_STREAM,0);
+    if (s < 0) {
+        return false;
+    }
+    fcntl(s,F_SETFD,FD_CLOEXEC);
+    fcntl(s,F_SETFL,fcntl(s,F_GETFL,0)|O_NONBLOCK);
+    if (::connect(s,addr,addrLength) != 0) {
+        if (errno != EINPROGRESS) {
+            close(s);
+            return false;
+        }
+        struct pollfd p;
+        p.fd = s;
+        p.events = POLLOUT;
+        int error = 0;
+        socklen_t errorLength = sizeof(error);
+        if (poll(&p,1,POSIX_CLIENT_CONNECT_TIMEOUT) != 1 ||
+                getsockopt(s,SOL_SOCKET,SO_ERROR,&error,&errorLength) != 0 || error != 0) {
+            close(s);
+            return false;
+        }
+    }
+    int on = 1;
+    setsockopt(s,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+#ifdef SO_NOSIGPIPE
+    setsockopt(s,SOL_SOCKET,SO_NOSIGPIPE,&on,sizeof(on));
+#endif
+#if POSIX_CLIENT_KEEPALIVE_IDLE > 0
+    int idle = POSIX_CLIENT_KEEPALIVE_IDLE;
+    setsockopt(s,SOL_SOCKET,SO_KEEPALIVE,&on,sizeof(on));
+#if defined(TCP_KEEPIDLE)
+    setsockopt(s,IPPROTO_TCP,TCP_KEEPIDLE,&idle,sizeof(idle));
+#elif defined(TCP_KEEPALIVE)
+    setsockopt(s,IPPROTO_TCP,TCP_KEEPALIVE,&idle,sizeof(idle));
+#endif
+#endif
+    this->sock = s;
+    return true;
+}
+
+size_t PosixClient::write(uint8_t b) {
+    return write(&b,1);
+}
+
+size_t PosixClient::write(const uint8_t *buf, size_t size) {
+    if (this->sock < 0) {
+        return 0;
+    }
+    ssize_t rc = send(this->sock,buf,size,MSG_NOSIGNAL);
+    // Nothing fits in the send buffer (EAGAIN), or the connection has gone
+    return (rc < 0)?0:rc;
+}
+
+size_t PosixClient::writev(const uint8_t* const* buffers, const size_t* lengths, uint8_t count) {
+    if (this->sock < 0) {
+        return 0;
+    }
+    // sendmsg() rather than writev(), which has no way to pass MSG_NOSIGNAL
+    size_t total = 0;
+    uint8_t i = 0;
+    while (i < count) {
+        struct iovec iov[POSIX_CLIENT_IOV_MAX];
+        struct msghdr msg;
+        memset(&msg,0,sizeof(msg));
+        size_t wanted = 0;
+        uint8_t n = 0;
+        for (; n < POSIX_CLIENT_IOV_MAX && i+n < count; n++) {
+            iov[n].iov_base = (void*)buffers[i+n];
+            iov[n].iov_len = lengths[i+n];
+            wanted += lengths[i+n];
+        }
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t rc = sendmsg(this->sock,&msg,MSG_NOSIGNAL);
+        if (rc <= 0) {
+            break;
+        }
+        total += rc;
+        if ((size_t)rc < wanted) {
+            // The send buffer is full
+            break;
+        }
+        i += n;
+    }
+    return total;
+}
+
+int PosixClient::available() {
+    int n = 0;
+    if (this->sock < 0 || ioctl(this->sock,FIONREAD,&n) != 0) {
+        return 0;
+    }
+    return n;
+}
+
+int PosixClient::read() {
+    uint8_t b;
+    return (read(&b,1) == 1)?b:-1;
+}
+
+int PosixClient::read(uint8_t *buf, size_t size) {
+    if (this->sock < 0) {
+        return -1;
+    }
+    ssize_t rc = recv(this->sock,buf,size,0);
+    return (rc > 0)?rc:-1;
+}
+
+int PosixClient::peek() {
+    uint8_t b;
+    if (this->sock < 0 || recv(this->sock,&b,1,MSG_PEEK) != 1) {
+        return -1;
+    }
+    return b;
+}
+
+void PosixClient::flush() {
+    // Anything written has already been passed to the socket
+}
+
+void PosixClient::stop() {
+    if (this->sock >= 0) {
+        close(this->sock);
+        this->sock = -1;
+    }
+}
+
+uint8_t PosixClient::connected() {
+    if (this->sock < 0) {
+        return 0;
+    }
+    // Still connected while there is data to read, or the server has not closed
+    // its end
+    uint8_t b;
+    ssize_t rc = recv(this->sock,&b,1,MSG_PEEK);
+    if (rc > 0) {
+        return 1;
+    }
+    return rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+PosixClient::operator bool() {
+    return this->sock >= 0;
+}
+
+int PosixClient::fd() {
+    return this->sock;
+}
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ PosixClient.h - A Client for PubSubClient on Linux and other POSIX systems,
+ over a non-blocking TCP socket.
+*/
+
+#ifndef PosixClient_h
+#define PosixClient_h
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include "ExtendedClient.h"
+
+// POSIX_CLIENT_CONNECT_TIMEOUT : how long connect() waits for the server, in
+//  milliseconds
+#ifndef POSIX_CLIENT_CONNECT_TIMEOUT
+#define POSIX_CLIENT_CONNECT_TIMEOUT 10000
+#endif
+
+// POSIX_CLIENT_KEEPALIVE_IDLE : seconds a connection can be idle before TCP
+//  starts checking the server is still there. The MQTT keepalive also does
+//  this, but TCP notices a dead connection while a publish is waiting to be
+//  sent. 0 leaves TCP keepalive off
+#ifndef POSIX_CLIENT_KEEPALIVE_IDLE
+#define POSIX_CLIENT_KEEPALIVE_IDLE 60
+#endif
+
+// A Client using a TCP socket directly, so the same sketch code can run on a
+// Linux gateway, or many times over in a load test.
+//
+// The socket is non-blocking once connected: write() takes what fits in the
+// socket's send buffer and returns how much that was, and read() returns what
+// has already arrived. PubSubClient holds on to the rest of a packet the socket
+// did not take and sends it ahead of anything else, from loop(), flush() or
+// onWritable(). Until it has gone, publish() returns false and write() returns
+// a short count, so the sketch can try again. Nagle's algorithm is turned off,
+// as each MQTT packet is written in one call and should go straight away.
+class PosixClient : public ExtendedClient {
+private:
+   int sock;
+   boolean open(const struct sockaddr* addr, uint32_t addrLength);
+public:
+   PosixClient();
+   virtual ~PosixClient();
+   virtual int connect(IPAddress ip, uint16_t port);
+   // Connects to the first address host resolves to that accepts a connection,
+   // IPv4 or IPv6
+   virtual int connect(const char *host, uint16_t port);
+   virtual size_t write(uint8_t);
+   virtual size_t write(const uint8_t *buf, size_t size);
+   virtual size_t writev(const uint8_t* const* buffers, const size_t* lengths, uint8_t count);
+   virtual int available();
+   virtual int read();
+   virtual int read(uint8_t *buf, size_t size);
+   virtual int peek();
+   virtual void flush();
+   virtual void stop();
+   virtual uint8_t connected();
+   virtual operator bool();
+   // The socket, or -1 when not connected. It is a new one after each connect
+   virtual int fd();
+};
+
+#endif
+
+#endif
@@ -7,159 +7,195 @@
 
 #include "PubSubClient.h"
 #include "Arduino.h"
+#if defined(ESP8266) || defined(ESP32)
+#include <new>
+#endif
 
-PubSubClient::PubSubClient() {
-    this->_state = MQTT_DISCONNECTED;
-    this->_client = NULL;
-    this->stream = NULL;
-    setCallback(NULL);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
-}
+// The most pieces sendPacket() is given a packet in: the fixed header, the topic,
+// the properties and the payload of a PUBLISH
+#define MQTT_MAX_PACKET_PIECES 4
 
-PubSubClient::PubSubClient(Client& client) {
-    this->_state = MQTT_DISCONNECTED;
-    setClient(client);
-    this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
-}
+// How much of a publish_P() payload is copied out of program memory at a time
+#define MQTT_PROGMEM_CHUNK_SIZE 32
 
-PubSubClient::PubSubClient(IPAddress addr, uint16_t port, Client& client) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(addr, port);
-    setClient(client);
-    this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
-}
-PubSubClient::PubSubClient(IPAddress addr, uint16_t port, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(addr,port);
-    setClient(client);
-    setStream(stream);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+// Packets that never change are sent from here rather than being built in a
+// buffer, so they cannot overwrite a message being received or sent
+static const uint8_t PINGREQ_PACKET[] = {MQTTPINGREQ, 0};
+static const uint8_t PINGRESP_PACKET[] = {MQTTPINGRESP, 0};
+static const uint8_t DISCONNECT_PACKET[] = {MQTTDISCONNECT, 0};
+
+// Memory from allocator, or from the heap without one
+static void* allocateFrom(MQTTAllocator* allocator, size_t size) {
+    if (allocator != NULL) {
+        return allocator->allocate(size);
+    }
+    return malloc(size);
 }
-PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(addr, port);
-    setCallback(callback);
-    setClient(client);
-    this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+
+static void releaseTo(MQTTAllocator* allocator, void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (allocator != NULL) {
+        allocator->release(ptr);
+    } else {
+        free(ptr);
+    }
 }
-PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(addr,port);
-    setCallback(callback);
-    setClient(client);
-    setStream(stream);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+
+// A trie node is allocated in one piece with the text of its level, which
+// follows it
+static MQTTTopicNode* newTopicNode(MQTTAllocator* allocator, const char* level, uint16_t length) {
+    MQTTTopicNode* node = (MQTTTopicNode*)allocateFrom(allocator,sizeof(MQTTTopicNode)+length+1);
+    if (node == NULL) {
+        return NULL;
+    }
+#if defined(ESP8266) || defined(ESP32)
+    // The handler is a std::function, which has to be constructed
+    new (node) MQTTTopicNode();
+#endif
+    node->level = (char*)(node+1);
+    memcpy(node->level,level,length);
+    node->level[length] = 0;
+    node->length = length;
+    node->child = NULL;
+    node->next = NULL;
+    node->handler = NULL;
+    return node;
 }
 
-PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, Client& client) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(ip, port);
-    setClient(client);
-    this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+static void deleteTopicNode(MQTTAllocator* allocator, MQTTTopicNode* node) {
+#if defined(ESP8266) || defined(ESP32)
+    node->~MQTTTopicNode();
+#endif
+    releaseTo(allocator,node);
 }
-PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(ip,port);
-    setClient(client);
-    setStream(stream);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+
+// Frees node, the nodes after it and everything below them
+static void freeTopicNodes(MQTTAllocator* allocator, MQTTTopicNode* node) {
+    while (node) {
+        MQTTTopicNode* next = node->next;
+        freeTopicNodes(allocator,node->child);
+        deleteTopicNode(allocator,node);
+        node = next;
+    }
 }
-PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(ip, port);
-    setCallback(callback);
-    setClient(client);
-    this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+
+// Copies node, the nodes after it and everything below them into memory from
+// allocator. Returns false, having copied nothing, if there is not enough
+static boolean copyTopicNodes(MQTTAllocator* allocator, const MQTTTopicNode* node, MQTTTopicNode** copy) {
+    *copy = NULL;
+    MQTTTopicNode** link = copy;
+    for (; node; node = node->next) {
+        MQTTTopicNode* n = newTopicNode(allocator,node->level,node->length);
+        if (n != NULL) {
+            n->handler = node->handler;
+            *link = n;
+            link = &n->next;
+        }
+        if (n == NULL || !copyTopicNodes(allocator,node->child,&n->child)) {
+            freeTopicNodes(allocator,*copy);
+            *copy = NULL;
+            return false;
+        }
+    }
+    return true;
 }
-PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(ip,port);
-    setCallback(callback);
-    setClient(client);
-    setStream(stream);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+
+// Returns how long is left of period milliseconds from the time from
+static uint32_t remaining(unsigned long now, unsigned long from, unsigned long period) {
+    unsigned long waited = now-from;
+    return (waited >= period)?0:period-waited;
 }
 
-PubSubClient::PubSubClient(const char* domain, uint16_t port, Client& client) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(domain,port);
-    setClient(client);
-    this->stream = NULL;
-    this->bufferSize = 0;
+PubSubClient::PubSubClient() {
+    init();
     setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
-PubSubClient::PubSubClient(const char* domain, uint16_t port, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(domain,port);
-    setClient(client);
-    setStream(stream);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+
+PubSubClient::PubSubClient(uint8_t* buffer, uint16_t size) {
+    init();
+    this->buffer = buffer;
+    this->bufferSize = size;
+    this->bufferFixed = true;
+    this->bufferCapacity = size;
+    this->txBuffer = buffer;
+    this->txBufferSize = size;
 }
-PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client) {
+
+// Everything a constructor sets up, apart from the buffer
+void PubSubClient::init() {
     this->_state = MQTT_DISCONNECTED;
-    setServer(domain,port);
-    setCallback(callback);
-    setClient(client);
+    setRawCallback(NULL);
+    setChunkCallbacks(NULL,NULL,NULL);
+    setConnectCallback(NULL);
+    setPublishCallback(NULL);
+    setSubscribeCallback(NULL);
+    setUnsubscribeCallback(NULL);
+    this->_client = NULL;
+    this->_extClient = NULL;
     this->stream = NULL;
+    setCallback(NULL);
+    this->buffer = NULL;
     this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
-    setKeepAlive(MQTT_KEEPALIVE);
-    setSocketTimeout(MQTT_SOCKET_TIMEOUT);
-}
-PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE, Client& client, Stream& stream) {
-    this->_state = MQTT_DISCONNECTED;
-    setServer(domain,port);
-    setCallback(callback);
-    setClient(client);
-    setStream(stream);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
+    this->bufferFixed = false;
+    this->txBuffer = NULL;
+    this->txBufferSize = 0;
+    this->txSeparate = false;
+    this->allocator = NULL;
+    this->inflight = NULL;
+    this->inflightBuffer = NULL;
+    this->inflightCount = 0;
+    this->store = NULL;
+    this->incomingQos2 = NULL;
+    this->incomingQos2Count = 0;
+    this->rxQos2Reserved = false;
+    this->subscriptions = NULL;
+    this->subscriptionCount = 0;
+    this->subscriptionNext = 0;
+    this->topicTrie = NULL;
+    this->offlineQueue = NULL;
+    this->offlineSize = 0;
+    this->offlineCount = 0;
+    this->outBuffer = NULL;
+    this->outHead = 0;
+    this->outUsed = 0;
+    this->outSize = MQTT_OUTBOUND_BUFFER_SIZE;
+    this->corked = false;
+    this->lastMsgId = 0;
+    this->sendRefused = false;
+    this->offlineDropped = 0;
+    this->connectionKeepAlive = MQTT_KEEPALIVE;
+    this->reconnectMinDelay = 0;
+    this->reconnectWanted = false;
+    this->reconnectPending = false;
+    this->reconnectFailures = 0;
+    this->reconnectRandom = 0;
+#if MQTT_VERSION == MQTT_VERSION_5
+    this->topicAliasCount = 0;
+#endif
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+    setRetryTimeout(MQTT_RETRY_TIMEOUT);
 }
 
 PubSubClient::~PubSubClient() {
-  free(this->buffer);
+  if (!this->bufferFixed) {
+    release(this->buffer);
+  }
+  if (this->txSeparate) {
+    release(this->txBuffer);
+  }
+  release(this->inflight);
+  release(this->inflightBuffer);
+  freeTopicNodes(this->allocator,this->topicTrie);
+  release(this->outBuffer);
+  release(this->offlineQueue);
+  release(this->incomingQos2);
+  release(this->subscriptions);
+#if MQTT_VERSION == MQTT_VERSION_5
+  clearTopicAliases();
+#endif
 }
 
 boolean PubSubClient::connect(const char *id) {
@@ -179,6 +215,54 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
 }
 
 boolean PubSubClient::connect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession) {
+    if (!connected()) {
+        if (!connectAsync(id,user,pass,willTopic,willQos,willRetain,willMessage,cleanSession)) {
+            return false;
+        }
+        while (this->_state == MQTT_CONNECTING) {
+            checkConnack();
+            if (this->_state == MQTT_CONNECTING) {
+                yield();
+            }
+        }
+        return this->_state == MQTT_CONNECTED;
+    }
+    return true;
+}
+
+boolean PubSubClient::connectAsync(const char *id) {
+    return connectAsync(id,NULL,NULL,0,0,0,0,1);
+}
+
+boolean PubSubClient::connectAsync(const char *id, const char *user, const char *pass) {
+    return connectAsync(id,user,pass,0,0,0,0,1);
+}
+
+boolean PubSubClient::connectAsync(const char *id, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage) {
+    return connectAsync(id,NULL,NULL,willTopic,willQos,willRetain,willMessage,1);
+}
+
+boolean PubSubClient::connectAsync(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage) {
+    return connectAsync(id,user,pass,willTopic,willQos,willRetain,willMessage,1);
+}
+
+boolean PubSubClient::connectAsync(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession) {
+    // Kept for loop() to reconnect with
+    this->connectId = id;
+    this->connectUser = user;
+    this->connectPass = pass;
+    this->connectWillTopic = willTopic;
+    this->connectWillQos = willQos;
+    this->connectWillRetain = willRetain;
+    this->connectWillMessage = willMessage;
+    this->connectCleanSession = cleanSession;
+    this->reconnectWanted = true;
+    this->reconnectPending = false;
+    this->reconnectFailures = 0;
+    if (this->_state == MQTT_CONNECTING && _client->connected()) {
+        // Already waiting for the CONNACK
+        return true;
+    }
     if (!connected()) {
         int result = 0;
 
@@ -195,6 +279,33 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
 
         if (result == 1) {
             nextMsgId = 1;
+            // Anything held back was for the old connection
+            this->outHead = 0;
+            this->outUsed = 0;
+            if (this->rxQos2Reserved) {
+                // Cut off part way through its payload, so it is passed on in full
+                // when the server sends it again
+                this->incomingQos2Count--;
+                this->rxQos2Reserved = false;
+            }
+            if (cleanSession) {
+                // The server forgets any QoS 2 messages it was part way through sending
+                this->incomingQos2Count = 0;
+            }
+            this->rxState = MQTT_RX_HEADER;
+            this->rxChunk = MQTT_CHUNK_NONE;
+            // Acknowledgements for anything subscribed before will not arrive
+            this->subscriptionCount = 0;
+            this->subscriptionNext = 0;
+            this->connectionKeepAlive = this->keepAlive;
+#if MQTT_VERSION == MQTT_VERSION_5
+            // Topic aliases and the server's limits only last for one connection
+            clearTopicAliases();
+            this->serverReceiveMaximum = 65535;
+            this->serverMaximumPacketSize = MQTT_MAX_HEADER_SIZE+MQTT_MAX_REMAINING_LENGTH;
+            this->serverMaximumQos = 2;
+            this->serverRetainAvailable = true;
+#endif
             // Leave room in the buffer for header and variable length field
             uint16_t length = MQTT_MAX_HEADER_SIZE;
             unsigned int j;
@@ -202,12 +313,12 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
 #if MQTT_VERSION == MQTT_VERSION_3_1
             uint8_t d[9] = {0x00,0x06,'M','Q','I','s','d','p', MQTT_VERSION};
 #define MQTT_HEADER_VERSION_LENGTH 9
-#elif MQTT_VERSION == MQTT_VERSION_3_1_1
+#elif MQTT_VERSION == MQTT_VERSION_3_1_1 || MQTT_VERSION == MQTT_VERSION_5
             uint8_t d[7] = {0x00,0x04,'M','Q','T','T',MQTT_VERSION};
 #define MQTT_HEADER_VERSION_LENGTH 7
 #endif
             for (j = 0;j<MQTT_HEADER_VERSION_LENGTH;j++) {
-                this->buffer[length++] = d[j];
+                this->txBuffer[length++] = d[j];
             }
 
             uint8_t v;
@@ -227,55 +338,59 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
                     v = v|(0x80>>1);
                 }
             }
-            this->buffer[length++] = v;
-
-            this->buffer[length++] = ((this->keepAlive) >> 8);
-            this->buffer[length++] = ((this->keepAlive) & 0xFF);
+            this->txBuffer[length++] = v;
+
+            this->txBuffer[length++] = ((this->keepAlive) >> 8);
+            this->txBuffer[length++] = ((this->keepAlive) & 0xFF);
+
+#if MQTT_VERSION == MQTT_VERSION_5
+            // Properties: how many QoS 1 and QoS 2 messages the server can send
+            // before they are acknowledged and, unless large messages can be passed
+            // on in chunks, how big a packet can be
+            uint16_t propertiesStart = length++;
+            this->txBuffer[length++] = MQTT_PROP_RECEIVE_MAXIMUM;
+            this->txBuffer[length++] = (MQTT_MAX_INCOMING_QOS2 >> 8);
+            this->txBuffer[length++] = (MQTT_MAX_INCOMING_QOS2 & 0xFF);
+            if (!this->stream && !messageChunk) {
+                this->txBuffer[length++] = MQTT_PROP_MAXIMUM_PACKET_SIZE;
+                this->txBuffer[length++] = 0;
+                this->txBuffer[length++] = 0;
+                // The most that can be received, not sent
+                this->txBuffer[length++] = (this->bufferSize >> 8);
+                this->txBuffer[length++] = (this->bufferSize & 0xFF);
+            }
+            this->txBuffer[propertiesStart] = length-propertiesStart-1;
+#endif
 
             CHECK_STRING_LENGTH(length,id)
-            length = writeString(id,this->buffer,length);
+            length = writeString(id,this->txBuffer,length);
             if (willTopic) {
+#if MQTT_VERSION == MQTT_VERSION_5
+                CHECK_STRING_LENGTH(length+1,willTopic)
+                // No will properties
+                this->txBuffer[length++] = 0;
+#endif
                 CHECK_STRING_LENGTH(length,willTopic)
-                length = writeString(willTopic,this->buffer,length);
+                length = writeString(willTopic,this->txBuffer,length);
                 CHECK_STRING_LENGTH(length,willMessage)
-                length = writeString(willMessage,this->buffer,length);
+                length = writeString(willMessage,this->txBuffer,length);
             }
 
             if(user != NULL) {
                 CHECK_STRING_LENGTH(length,user)
-                length = writeString(user,this->buffer,length);
+                length = writeString(user,this->txBuffer,length);
                 if(pass != NULL) {
                     CHECK_STRING_LENGTH(length,pass)
-                    length = writeString(pass,this->buffer,length);
+                    length = writeString(pass,this->txBuffer,length);
                 }
             }
 
-            write(MQTTCONNECT,this->buffer,length-MQTT_MAX_HEADER_SIZE);
+            write(MQTTCONNECT,this->txBuffer,length-MQTT_MAX_HEADER_SIZE);
+            flushOutbound();
 
             lastInActivity = lastOutActivity = millis();
-
-            while (!_client->available()) {
-                unsigned long t = millis();
-                if (t-lastInActivity >= ((int32_t) this->socketTimeout*1000UL)) {
-                    _state = MQTT_CONNECTION_TIMEOUT;
-                    _client->stop();
-                    return false;
-                }
-            }
-            uint8_t llen;
-            uint32_t len = readPacket(&llen);
-
-            if (len == 4) {
-                if (buffer[3] == 0) {
-                    lastInActivity = millis();
-                    pingOutstanding = false;
-                    _state = MQTT_CONNECTED;
-                    return true;
-                } else {
-                    _state = buffer[3];
-                }
-            }
-            _client->stop();
+            _state = MQTT_CONNECTING;
+            return true;
         } else {
             _state = MQTT_CONNECT_FAILED;
         }
@@ -284,282 +399,1360 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
     return true;
 }
 
-// reads a byte into result
-boolean PubSubClient::readByte(uint8_t * result) {
-   uint32_t previousMillis = millis();
-   while(!_client->available()) {
-     yield();
-     uint32_t currentMillis = millis();
-     if(currentMillis - previousMillis >= ((int32_t) this->socketTimeout * 1000)){
-       return false;
-     }
-   }
-   *result = _client->read();
-   return true;
-}
-
-// reads a byte into result[*index] and increments index
-boolean PubSubClient::readByte(uint8_t * result, uint16_t * index){
-  uint16_t current_index = *index;
-  uint8_t * write_address = &(result[current_index]);
-  if(readByte(write_address)){
-    *index = current_index + 1;
-    return true;
-  }
-  return false;
+// Completes a connect started by connectAsync once the CONNACK has arrived, the
+// connection has dropped or socketTimeout has expired.
+void PubSubClient::checkConnack() {
+    uint8_t llen;
+    uint32_t len = readPacket(&llen);
+    if (len == 0) {
+        // If the state has changed, readPacket has closed the connection
+        if (this->_state == MQTT_CONNECTING) {
+            if (!_client->connected()) {
+                _state = MQTT_CONNECT_FAILED;
+            } else if (millis()-lastInActivity >= ((int32_t) this->socketTimeout*1000UL)) {
+                _state = MQTT_CONNECTION_TIMEOUT;
+                _client->stop();
+            } else {
+                // Still waiting
+                return;
+            }
+        }
+#if MQTT_VERSION == MQTT_VERSION_5
+    } else if (len >= (uint32_t)llen+3 && (this->buffer[0]&0xF0) == MQTTCONNACK) {
+#else
+    } else if (len == 4 && (this->buffer[0]&0xF0) == MQTTCONNACK) {
+#endif
+        if (buffer[llen+2] == 0) {
+            lastInActivity = millis();
+            pingOutstanding = false;
+            _state = MQTT_CONNECTED;
+            this->reconnectFailures = 0;
+#if MQTT_VERSION == MQTT_VERSION_5
+            readConnackProperties(this->buffer+llen+3,len-llen-3);
+#endif
+            // Anything not acknowledged on the last connection is sent again,
+            // then anything published while disconnected
+            resendInflight(true);
+            restoreInflight();
+            flushOffline();
+        } else {
+            _state = buffer[llen+2];
+            _client->stop();
+        }
+    } else {
+        _state = MQTT_CONNECT_FAILED;
+        _client->stop();
+    }
+    if (connectCallback) {
+        connectCallback(this->_state);
+    }
 }
 
+// Reads as much of the current inbound packet as is available without blocking.
+// The position in the packet is kept between calls, so a packet that arrives in
+// several pieces is assembled over several calls.
+// Returns the length of the packet in the buffer once it has been completely
+// received, or 0 if more data is needed or the packet was dropped.
 uint32_t PubSubClient::readPacket(uint8_t* lengthLength) {
-    uint16_t len = 0;
-    if(!readByte(this->buffer, &len)) return 0;
-    bool isPublish = (this->buffer[0]&0xF0) == MQTTPUBLISH;
-    uint32_t multiplier = 1;
-    uint32_t length = 0;
-    uint8_t digit = 0;
-    uint16_t skip = 0;
-    uint32_t start = 0;
-
-    do {
-        if (len == 5) {
-            // Invalid remaining length encoding - kill the connection
-            _state = MQTT_DISCONNECTED;
-            _client->stop();
-            return 0;
+    // Bytes that do not fit in the buffer are read here so they can still be
+    // passed to the stream
+    uint8_t overflow[MQTT_READ_CHUNK_SIZE];
+
+    while (true) {
+        if (this->rxChunk == MQTT_CHUNK_WAITING && this->rxIndex == this->rxPayloadStart) {
+            // The topic is in the buffer - start passing the payload to the chunk callbacks
+            uint16_t tl = (this->buffer[this->rxLengthLength+1]<<8)+this->buffer[this->rxLengthLength+2];
+            this->rxChunk = MQTT_CHUNK_STARTED;
+            if ((this->buffer[0]&0x06) == MQTTQOS2) {
+                uint8_t* id = this->buffer+this->rxLengthLength+3+tl;
+                uint16_t msgId = (id[0]<<8)+id[1];
+                if (findIncomingQos2(msgId) >= 0) {
+                    // Already delivered - read past the payload without passing it on
+                    this->rxChunk = MQTT_CHUNK_DUPLICATE;
+                } else if (addIncomingQos2(msgId)) {
+                    // Its place is taken before any of it is passed on, so it
+                    // can only be delivered once
+                    this->rxQos2Reserved = true;
+                } else {
+                    // No room to remember it, so drop the connection before any
+                    // of it is passed on. The server sends it again once the
+                    // connection has been made again
+                    abortConnection();
+                    return 0;
+                }
+            }
+            if (messageBegin && this->rxChunk == MQTT_CHUNK_STARTED) {
+                messageBegin((char*)this->buffer+this->rxLengthLength+3,tl,this->rxEnd-this->rxPayloadStart);
+            }
         }
-        if(!readByte(&digit)) return 0;
-        this->buffer[len++] = digit;
-        length += (digit & 127) * multiplier;
-        multiplier <<=7; //multiplier *= 128
-    } while ((digit & 128) != 0);
-    *lengthLength = len-1;
-
-    if (isPublish) {
-        // Read in topic length to calculate bytes to skip over for Stream writing
-        if(!readByte(this->buffer, &len)) return 0;
-        if(!readByte(this->buffer, &len)) return 0;
-        skip = (this->buffer[*lengthLength+1]<<8)+this->buffer[*lengthLength+2];
-        start = 2;
-        if (this->buffer[0]&MQTTQOS1) {
-            // skip message id
-            skip += 2;
+#if MQTT_VERSION == MQTT_VERSION_5
+        if (this->rxState == MQTT_RX_BODY && this->rxProperties && this->rxIndex == this->rxPayloadStart && this->rxIndex < this->rxEnd) {
+            // Read the length of the properties a byte at a time
+            this->rxState = MQTT_RX_PROPERTIES;
+            this->rxRemaining = 0;
+            this->rxMultiplier = 1;
         }
-    }
-    uint32_t idx = len;
-
-    for (uint32_t i = start;i<length;i++) {
-        if(!readByte(&digit)) return 0;
-        if (this->stream) {
-            if (isPublish && idx-*lengthLength-2>skip) {
-                this->stream->write(digit);
+#endif
+        if (this->rxState == MQTT_RX_BODY && this->rxIndex == this->rxEnd) {
+            // Packet complete - get ready for the next one
+            this->rxState = MQTT_RX_HEADER;
+            this->rxQos2Reserved = false;
+            *lengthLength = this->rxLengthLength;
+            if (!this->stream && this->rxChunk == MQTT_CHUNK_NONE && this->rxIndex > this->bufferSize) {
+                return 0; // This will cause the packet to be ignored.
             }
+            return this->rxLen;
         }
-
-        if (len < this->bufferSize) {
-            this->buffer[len] = digit;
-            len++;
+        if (!_client->available()) {
+            return 0;
         }
-        idx++;
-    }
-
-    if (!this->stream && idx > this->bufferSize) {
-        len = 0; // This will cause the packet to be ignored.
-    }
-    return len;
-}
-
-boolean PubSubClient::loop() {
-    if (connected()) {
-        unsigned long t = millis();
-        if ((t - lastInActivity > this->keepAlive*1000UL) || (t - lastOutActivity > this->keepAlive*1000UL)) {
-            if (pingOutstanding) {
-                this->_state = MQTT_CONNECTION_TIMEOUT;
-                _client->stop();
-                return false;
+        if (this->rxState == MQTT_RX_BODY) {
+            // Read the rest of the packet in as few calls to the client as possible
+            uint32_t n = _client->available();
+            if (n > this->rxEnd-this->rxIndex) {
+                n = this->rxEnd-this->rxIndex;
+            }
+#if MQTT_VERSION == MQTT_VERSION_5
+            if (this->rxProperties && n > this->rxPayloadStart-this->rxIndex) {
+                // Stop at the length of the properties
+                n = this->rxPayloadStart-this->rxIndex;
+            }
+#endif
+            uint8_t* dest;
+            if (this->rxChunk == MQTT_CHUNK_STARTED) {
+                // The payload is read into the space after the topic, one chunk at a time
+                dest = this->buffer+this->rxPayloadStart;
+                if (n > (uint32_t)(this->bufferSize-this->rxPayloadStart)) {
+                    n = this->bufferSize-this->rxPayloadStart;
+                }
+            } else if (this->rxChunk == MQTT_CHUNK_WAITING && n > this->rxPayloadStart-this->rxIndex) {
+                // Stop at the end of the topic so the chunks can begin
+                dest = this->buffer+this->rxLen;
+                n = this->rxPayloadStart-this->rxIndex;
+            } else if (this->rxLen < this->bufferSize) {
+                dest = this->buffer+this->rxLen;
+                if (n > (uint32_t)(this->bufferSize-this->rxLen)) {
+                    n = this->bufferSize-this->rxLen;
+                }
             } else {
-                this->buffer[0] = MQTTPINGREQ;
-                this->buffer[1] = 0;
-                _client->write(this->buffer,2);
-                lastOutActivity = t;
-                lastInActivity = t;
-                pingOutstanding = true;
+                dest = overflow;
+                if (n > MQTT_READ_CHUNK_SIZE) {
+                    n = MQTT_READ_CHUNK_SIZE;
+                }
             }
-        }
-        if (_client->available()) {
-            uint8_t llen;
-            uint16_t len = readPacket(&llen);
-            uint16_t msgId = 0;
-            uint8_t *payload;
-            if (len > 0) {
-                lastInActivity = t;
-                uint8_t type = this->buffer[0]&0xF0;
-                if (type == MQTTPUBLISH) {
-                    if (callback) {
-                        uint16_t tl = (this->buffer[llen+1]<<8)+this->buffer[llen+2]; /* topic length in bytes */
-                        memmove(this->buffer+llen+2,this->buffer+llen+3,tl); /* move topic inside buffer 1 byte to front */
-                        this->buffer[llen+2+tl] = 0; /* end the topic as a 'C' string with \x00 */
-                        char *topic = (char*) this->buffer+llen+2;
-                        // msgId only present for QOS>0
-                        if ((this->buffer[0]&0x06) == MQTTQOS1) {
-                            msgId = (this->buffer[llen+3+tl]<<8)+this->buffer[llen+3+tl+1];
-                            payload = this->buffer+llen+3+tl+2;
-                            callback(topic,payload,len-llen-3-tl-2);
-
-                            this->buffer[0] = MQTTPUBACK;
-                            this->buffer[1] = 2;
-                            this->buffer[2] = (msgId >> 8);
-                            this->buffer[3] = (msgId & 0xFF);
-                            _client->write(this->buffer,4);
-                            lastOutActivity = t;
-
-                        } else {
-                            payload = this->buffer+llen+3+tl;
-                            callback(topic,payload,len-llen-3-tl);
-                        }
+            int rc = _client->read(dest,n);
+            if (rc <= 0) {
+                return 0;
+            }
+            if (this->stream && this->rxChunk != MQTT_CHUNK_DUPLICATE && this->rxIndex+rc > this->rxPayloadStart) {
+                uint32_t offset = (this->rxIndex < this->rxPayloadStart)?(this->rxPayloadStart-this->rxIndex):0;
+                this->stream->write(dest+offset,rc-offset);
+            }
+            if (this->rxChunk == MQTT_CHUNK_STARTED) {
+                messageChunk(dest,rc);
+            } else if (dest != overflow) {
+                this->rxLen += rc;
+            }
+            this->rxIndex += rc;
+        } else {
+            int c = _client->read();
+            if (c < 0) {
+                return 0;
+            }
+            uint8_t digit = c;
+            if (this->rxState == MQTT_RX_HEADER) {
+                this->buffer[0] = digit;
+                this->rxLen = 1;
+                this->rxRemaining = 0;
+                this->rxMultiplier = 1;
+                this->rxChunk = MQTT_CHUNK_NONE;
+#if MQTT_VERSION == MQTT_VERSION_5
+                this->rxProperties = false;
+#endif
+                this->rxState = MQTT_RX_LENGTH;
+            } else if (this->rxState == MQTT_RX_LENGTH) {
+                if (this->rxLen == 5) {
+                    // Invalid remaining length encoding - kill the connection
+                    this->rxState = MQTT_RX_HEADER;
+                    _state = MQTT_DISCONNECTED;
+                    _client->stop();
+                    return 0;
+                }
+                this->buffer[this->rxLen++] = digit;
+                this->rxRemaining += (digit & 127) * this->rxMultiplier;
+                this->rxMultiplier <<=7; //multiplier *= 128
+                if ((digit & 128) == 0) {
+                    this->rxLengthLength = this->rxLen-1;
+                    this->rxIndex = this->rxLen;
+                    this->rxEnd = this->rxIndex+this->rxRemaining;
+                    // Nothing is passed to the stream unless this is a publish
+                    this->rxPayloadStart = this->rxEnd;
+                    if ((this->buffer[0]&0xF0) == MQTTPUBLISH && this->rxRemaining >= 2) {
+                        this->rxState = MQTT_RX_VARIABLE_HEADER;
+                    } else {
+                        this->rxState = MQTT_RX_BODY;
                     }
-                } else if (type == MQTTPINGREQ) {
-                    this->buffer[0] = MQTTPINGRESP;
-                    this->buffer[1] = 0;
-                    _client->write(this->buffer,2);
-                } else if (type == MQTTPINGRESP) {
-                    pingOutstanding = false;
                 }
-            } else if (!connected()) {
-                // readPacket has closed the connection
-                return false;
+            } else if (this->rxState == MQTT_RX_VARIABLE_HEADER) {
+                // Read in topic length to calculate bytes to skip over for Stream writing
+                this->buffer[this->rxLen++] = digit;
+                this->rxIndex++;
+                if (this->rxLen == this->rxLengthLength+3) {
+                    uint32_t skip = (this->buffer[this->rxLengthLength+1]<<8)+this->buffer[this->rxLengthLength+2];
+                    if (this->buffer[0]&(MQTTQOS1|MQTTQOS2)) {
+                        // skip message id
+                        skip += 2;
+                    }
+                    this->rxPayloadStart = this->rxIndex+skip;
+                    this->rxState = MQTT_RX_BODY;
+#if MQTT_VERSION == MQTT_VERSION_5
+                    // The payload starts after the properties
+                    this->rxProperties = true;
+#else
+                    if (messageChunk && this->rxEnd > this->bufferSize && this->rxPayloadStart < this->bufferSize) {
+                        // Too big for the buffer, but the topic fits - pass the payload on in chunks
+                        this->rxChunk = MQTT_CHUNK_WAITING;
+                    }
+#endif
+                }
+#if MQTT_VERSION == MQTT_VERSION_5
+            } else {
+                // The length of the properties of a PUBLISH, which are then skipped
+                if (this->rxLen < this->bufferSize) {
+                    this->buffer[this->rxLen++] = digit;
+                }
+                this->rxIndex++;
+                this->rxRemaining += (digit & 127) * this->rxMultiplier;
+                this->rxMultiplier <<= 7;
+                if ((digit & 128) == 0 || this->rxIndex == this->rxEnd) {
+                    this->rxPayloadStart = this->rxIndex+this->rxRemaining;
+                    if (this->rxPayloadStart > this->rxEnd) {
+                        this->rxPayloadStart = this->rxEnd;
+                    }
+                    this->rxProperties = false;
+                    this->rxState = MQTT_RX_BODY;
+                    if (messageChunk && this->rxEnd > this->bufferSize && this->rxPayloadStart < this->bufferSize) {
+                        // Too big for the buffer, but the topic fits - pass the payload on in chunks
+                        this->rxChunk = MQTT_CHUNK_WAITING;
+                    }
+                }
+#endif
             }
         }
-        return true;
+        lastInActivity = millis();
     }
-    return false;
-}
-
-boolean PubSubClient::publish(const char* topic, const char* payload) {
-    return publish(topic,(const uint8_t*)payload, payload ? strnlen(payload, this->bufferSize) : 0,false);
-}
-
-boolean PubSubClient::publish(const char* topic, const char* payload, boolean retained) {
-    return publish(topic,(const uint8_t*)payload, payload ? strnlen(payload, this->bufferSize) : 0,retained);
-}
-
-boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength) {
-    return publish(topic, payload, plength, false);
 }
 
-boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
+boolean PubSubClient::loop() {
+    if (this->_state == MQTT_CONNECTING) {
+        checkConnack();
+    }
+    reconnectIfDue();
     if (connected()) {
-        if (this->bufferSize < MQTT_MAX_HEADER_SIZE + 2+strnlen(topic, this->bufferSize) + plength) {
-            // Too long
+        flushOutbound();
+        if (!checkKeepAlive()) {
             return false;
         }
-        // Leave room in the buffer for header and variable length field
-        uint16_t length = MQTT_MAX_HEADER_SIZE;
-        length = writeString(topic,this->buffer,length);
-
-        // Add payload
-        uint16_t i;
-        for (i=0;i<plength;i++) {
-            this->buffer[length++] = payload[i];
+        if (this->inflightCount > 0) {
+            resendInflight(false);
         }
-
-        // Write the header
-        uint8_t header = MQTTPUBLISH;
-        if (retained) {
-            header |= 1;
+        if (this->offlineCount > 0) {
+            flushOffline();
         }
-        return write(header,this->buffer,length-MQTT_MAX_HEADER_SIZE);
+        if (_client->available()) {
+            return handleInbound();
+        }
+        return true;
     }
     return false;
 }
 
-boolean PubSubClient::publish_P(const char* topic, const char* payload, boolean retained) {
-    return publish_P(topic, (const uint8_t*)payload, payload ? strnlen(payload, this->bufferSize) : 0, retained);
+boolean PubSubClient::onReadable() {
+    if (this->_state == MQTT_CONNECTING) {
+        checkConnack();
+    }
+    // Everything that has arrived, as the host may not say again until more does
+    while (connected() && _client->available()) {
+        if (!handleInbound()) {
+            return false;
+        }
+    }
+    return connected();
 }
 
-boolean PubSubClient::publish_P(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
-    uint8_t llen = 0;
-    uint8_t digit;
-    unsigned int rc = 0;
-    uint16_t tlen;
-    unsigned int pos = 0;
-    unsigned int i;
-    uint8_t header;
-    unsigned int len;
-    int expectedLength;
-
+boolean PubSubClient::onWritable() {
     if (!connected()) {
         return false;
     }
-
-    tlen = strnlen(topic, this->bufferSize);
-
-    header = MQTTPUBLISH;
-    if (retained) {
-        header |= 1;
+    flushOutbound();
+    if (this->offlineCount > 0) {
+        flushOffline();
     }
-    this->buffer[pos++] = header;
-    len = plength + 2 + tlen;
-    do {
+    return true;
+}
+
+boolean PubSubClient::onTimer() {
+    if (this->_state == MQTT_CONNECTING) {
+        // Gives up once socketTimeout has passed
+        checkConnack();
+    }
+    reconnectIfDue();
+    if (!connected()) {
+        return false;
+    }
+    if (!checkKeepAlive()) {
+        return false;
+    }
+    if (this->inflightCount > 0) {
+        resendInflight(false);
+    }
+    return true;
+}
+
+boolean PubSubClient::wantsRead() {
+    return this->_state == MQTT_CONNECTING || this->_state == MQTT_CONNECTED;
+}
+
+boolean PubSubClient::wantsWrite() {
+    return wantsRead() && this->outUsed > 0 && !this->corked;
+}
+
+int PubSubClient::getFd() {
+    return (this->_extClient != NULL)?this->_extClient->fd():-1;
+}
+
+// Starts the next attempt to reconnect, if one is due
+void PubSubClient::reconnectIfDue() {
+    if (nextAttemptIn() == 0) {
+        // connectAsync() starts the count again, as for a connect from the sketch
+        uint16_t failures = this->reconnectFailures+1;
+        connectAsync(this->connectId,this->connectUser,this->connectPass,this->connectWillTopic,this->connectWillQos,this->connectWillRetain,this->connectWillMessage,this->connectCleanSession);
+        this->reconnectFailures = failures;
+    }
+}
+
+// Sends a PINGREQ once the connection has been quiet for connectionKeepAlive seconds.
+// Returns false, having closed the connection, if the last one was not answered
+boolean PubSubClient::checkKeepAlive() {
+    unsigned long t = millis();
+    if ((t - lastInActivity > this->connectionKeepAlive*1000UL) || (t - lastOutActivity > this->connectionKeepAlive*1000UL)) {
+        if (pingOutstanding) {
+            this->_state = MQTT_CONNECTION_TIMEOUT;
+            _client->stop();
+            return false;
+        } else {
+            if (sendBytes(PINGREQ_PACKET,2)) {
+                lastInActivity = t;
+                pingOutstanding = true;
+            }
+        }
+    }
+    return true;
+}
+
+// Reads the next packet from the server, or as much of it as has arrived, and
+// acts on it once it is complete. Returns false if the connection has closed
+boolean PubSubClient::handleInbound() {
+    uint8_t llen;
+    uint16_t len = readPacket(&llen);
+    uint16_t msgId = 0;
+    uint8_t *payload;
+    if (len > 0) {
+        lastInActivity = millis();
+        uint8_t type = this->buffer[0]&0xF0;
+        if (type == MQTTPUBLISH) {
+            uint16_t tl = (this->buffer[llen+1]<<8)+this->buffer[llen+2]; /* topic length in bytes */
+            uint16_t payloadStart = llen+3+tl;
+            // msgId only present for QOS>0
+            uint8_t qos = this->buffer[0]&0x06;
+            if (qos) {
+                msgId = (this->buffer[payloadStart]<<8)+this->buffer[payloadStart+1];
+                payloadStart += 2;
+            }
+#if MQTT_VERSION == MQTT_VERSION_5
+            uint32_t properties = skipProperties(this->buffer+payloadStart,len-payloadStart);
+            if (properties == 0) {
+                // Malformed
+                return true;
+            }
+            payloadStart += properties;
+#endif
+            boolean deliver = true;
+            if (qos == MQTTQOS2) {
+                if (this->rxChunk == MQTT_CHUNK_STARTED) {
+                    // readPacket() took its place before passing the payload on
+                } else if (this->rxChunk == MQTT_CHUNK_DUPLICATE || findIncomingQos2(msgId) >= 0) {
+                    // Resent by the server - already delivered
+                    deliver = false;
+                } else if (!addIncomingQos2(msgId)) {
+                    // No room to remember the message, so it cannot be delivered
+                    // exactly once. Without a PUBREC the server sends it again once
+                    // the connection has been made again
+                    abortConnection();
+                    return false;
+                }
+            }
+            if (!deliver) {
+                // Nothing to pass on
+            } else if (this->rxChunk == MQTT_CHUNK_STARTED) {
+                // The payload has already been passed to the chunk callbacks
+                if (messageEnd) {
+                    messageEnd();
+                }
+            } else {
+                payload = this->buffer+payloadStart;
+                if (rawCallback) {
+                    // The topic is passed where it sits in the buffer, so is not null terminated
+                    rawCallback((char*) this->buffer+llen+3,tl,payload,len-payloadStart);
+                }
+                if (callback || this->topicTrie) {
+                    memmove(this->buffer+llen+2,this->buffer+llen+3,tl); /* move topic inside buffer 1 byte to front */
+                    this->buffer[llen+2+tl] = 0; /* end the topic as a 'C' string with \x00 */
+                    char *topic = (char*) this->buffer+llen+2;
+                    if (!dispatch(this->topicTrie,topic,topic,payload,len-payloadStart) && callback) {
+                        callback(topic,payload,len-payloadStart);
+                    }
+                }
+            }
+            if (qos == MQTTQOS1) {
+                sendAck(MQTTPUBACK,msgId);
+            } else if (qos == MQTTQOS2) {
+                sendAck(MQTTPUBREC,msgId);
+            }
+        } else if (type == MQTTPUBACK || type == MQTTPUBREC || type == MQTTPUBCOMP) {
+            if (len >= 4) {
+                msgId = (this->buffer[llen+1]<<8)+this->buffer[llen+2];
+                uint8_t reason = 0;
+#if MQTT_VERSION == MQTT_VERSION_5
+                if (len > llen+3) {
+                    reason = this->buffer[llen+3];
+                }
+#endif
+                ackInflight(type,msgId,reason);
+            }
+        } else if (type == MQTTPUBREL) {
+            if (len >= 4) {
+                msgId = (this->buffer[llen+1]<<8)+this->buffer[llen+2];
+                int i = findIncomingQos2(msgId);
+                if (i >= 0) {
+                    this->incomingQos2[i] = this->incomingQos2[--this->incomingQos2Count];
+                }
+                sendAck(MQTTPUBCOMP,msgId);
+            }
+        } else if (type == MQTTSUBACK) {
+            if (len >= 4) {
+                msgId = (this->buffer[llen+1]<<8)+this->buffer[llen+2];
+                uint16_t start = llen+3;
+#if MQTT_VERSION == MQTT_VERSION_5
+                uint32_t properties = skipProperties(this->buffer+start,len-start);
+                if (properties == 0) {
+                    // Malformed
+                    return true;
+                }
+                start += properties;
+#endif
+                const uint8_t* results = this->buffer+start;
+                uint16_t count = len-start;
+                MQTTSubscribeStatus* status = findSubscription(msgId);
+                if (status) {
+                    status->status = 0x02;
+                    for (uint16_t i = 0; i < count; i++) {
+                        if (results[i] > 0x02) {
+                            status->status = MQTT_SUBSCRIBE_FAILED;
+                            break;
+                        } else if (results[i] < status->status) {
+                            status->status = results[i];
+                        }
+                    }
+                }
+                if (subscribeCallback) {
+                    subscribeCallback(msgId,results,count);
+                }
+            }
+        } else if (type == MQTTUNSUBACK) {
+            if (len >= 4) {
+                msgId = (this->buffer[llen+1]<<8)+this->buffer[llen+2];
+                MQTTSubscribeStatus* status = findSubscription(msgId);
+                if (status) {
+                    status->status = 0;
+#if MQTT_VERSION == MQTT_VERSION_5
+                    uint16_t start = llen+3;
+                    uint32_t properties = skipProperties(this->buffer+start,len-start);
+                    for (uint16_t i = start+properties; properties > 0 && i < len; i++) {
+                        if (this->buffer[i] >= 0x80) {
+                            status->status = MQTT_SUBSCRIBE_FAILED;
+                        }
+                    }
+#endif
+                }
+                if (unsubscribeCallback) {
+                    unsubscribeCallback(msgId);
+                }
+            }
+        } else if (type == MQTTPINGREQ) {
+            sendControl(PINGRESP_PACKET,2);
+        } else if (type == MQTTPINGRESP) {
+            pingOutstanding = false;
+#if MQTT_VERSION == MQTT_VERSION_5
+        } else if (type == MQTTDISCONNECT) {
+            // The server is closing the connection, and may say why
+            this->_state = (len > llen+1 && this->buffer[llen+1] != 0)?this->buffer[llen+1]:MQTT_DISCONNECTED;
+            _client->stop();
+            return false;
+#endif
+        }
+    } else if (!connected()) {
+        // readPacket has closed the connection
+        return false;
+    }
+    return true;
+}
+
+boolean PubSubClient::publish(const char* topic, const char* payload) {
+    return publish(topic,(const uint8_t*)payload, payload ? strlen(payload) : 0,false);
+}
+
+boolean PubSubClient::publish(const char* topic, const char* payload, boolean retained) {
+    return publish(topic,(const uint8_t*)payload, payload ? strlen(payload) : 0,retained);
+}
+
+boolean PubSubClient::publish(const char* topic, const uint8_t* payload, uint32_t plength) {
+    return publish(topic, payload, plength, false);
+}
+
+boolean PubSubClient::publish(const char* topic, const uint8_t* payload, uint32_t plength, boolean retained) {
+    return publish(topic, payload, plength, retained, 0);
+}
+
+boolean PubSubClient::publish(const char* topic, const char* payload, boolean retained, uint8_t qos) {
+    return publish(topic,(const uint8_t*)payload, payload ? strlen(payload) : 0,retained,qos);
+}
+
+boolean PubSubClient::publish(const char* topic, const uint8_t* payload, uint32_t plength, boolean retained, uint8_t qos) {
+    boolean online = connected();
+    if (online || this->offlineQueue) {
+        size_t tlen = strnlen(topic, this->txBufferSize);
+        if (this->txBufferSize < MQTT_MAX_HEADER_SIZE + 2+tlen) {
+            // Too long
+            return false;
+        }
+        // Encode the topic where a QoS 0 packet is sent from
+        writeString(topic,this->txBuffer,MQTT_MAX_HEADER_SIZE);
+        if (!online || this->offlineCount > 0) {
+            // Wait behind anything published while disconnected
+            return queueOffline(this->txBuffer+MQTT_MAX_HEADER_SIZE,2+tlen,payload,plength,retained,qos);
+        }
+        return publishEncoded(this->txBuffer+MQTT_MAX_HEADER_SIZE,2+tlen,payload,plength,retained,qos);
+    }
+    return false;
+}
+
+boolean PubSubClient::publish(const TopicHandle& topic, const char* payload) {
+    return publish(topic,(const uint8_t*)payload, payload ? strlen(payload) : 0,false,0);
+}
+
+boolean PubSubClient::publish(const TopicHandle& topic, const uint8_t* payload, uint32_t plength) {
+    return publish(topic,payload,plength,false,0);
+}
+
+boolean PubSubClient::publish(const TopicHandle& topic, const uint8_t* payload, uint32_t plength, boolean retained) {
+    return publish(topic,payload,plength,retained,0);
+}
+
+boolean PubSubClient::publish(const TopicHandle& topic, const uint8_t* payload, uint32_t plength, boolean retained, uint8_t qos) {
+    if (!topic.valid()) {
+        return false;
+    }
+    if (!connected() || this->offlineCount > 0) {
+        return queueOffline(topic.bytes(),topic.length(),payload,plength,retained,qos);
+    }
+    return publishEncoded(topic.bytes(),topic.length(),payload,plength,retained,qos);
+}
+
+// Publishes with a topic that is already encoded with its length prefix. tlen
+// includes the prefix
+boolean PubSubClient::publishEncoded(const uint8_t* topic, uint16_t tlen, const uint8_t* payload, uint32_t plength, boolean retained, uint8_t qos) {
+    if (qos > 2) {
+        return false;
+    }
+#if MQTT_VERSION == MQTT_VERSION_5
+    if (qos > this->serverMaximumQos || (retained && !this->serverRetainAvailable)) {
+        // Not allowed by the server
+        return false;
+    }
+#endif
+    uint8_t header = MQTTPUBLISH|(qos << 1);
+    if (retained) {
+        header |= 1;
+    }
+    if (qos == 0) {
+        // Only the topic has to fit in the buffer
+        if (this->txBufferSize < MQTT_MAX_HEADER_SIZE + tlen + MQTT_PUBLISH_PROPERTIES_SIZE || plength > MQTT_MAX_REMAINING_LENGTH - tlen - MQTT_PUBLISH_PROPERTIES_SIZE) {
+            // Too long
+            return false;
+        }
+#if MQTT_VERSION == MQTT_VERSION_5
+        uint16_t alias = findTopicAlias(topic,tlen);
+        uint8_t* newAlias = NULL;
+        if (alias == 0 && this->topicAliasCount < this->topicAliasMaximum) {
+            // Send the topic this time, and set up an alias for next time
+            newAlias = (uint8_t*)allocate(tlen);
+            if (newAlias != NULL) {
+                memcpy(newAlias,topic,tlen);
+                alias = this->topicAliasCount+1;
+            }
+        }
+        if (alias != 0 && newAlias == NULL) {
+            // The alias alone, with an empty topic
+            static const uint8_t EMPTY_TOPIC[] = {0,0};
+            topic = EMPTY_TOPIC;
+            tlen = 2;
+        }
+        uint8_t properties[4];
+        uint8_t propertiesLength = 1;
+        properties[0] = 0;
+        if (alias != 0) {
+            properties[0] = 3;
+            properties[1] = MQTT_PROP_TOPIC_ALIAS;
+            properties[2] = (alias >> 8);
+            properties[3] = (alias & 0xFF);
+            propertiesLength = 4;
+        }
+        boolean rc = withinMaximumPacketSize(tlen+propertiesLength+plength) && writePublish(header,topic,tlen,properties,propertiesLength,payload,plength);
+        if (newAlias != NULL) {
+            if (rc) {
+                this->topicAliases[this->topicAliasCount++] = newAlias;
+            } else {
+                release(newAlias);
+            }
+        }
+        return rc;
+#else
+        return writePublish(header,topic,tlen,NULL,0,payload,plength);
+#endif
+    }
+    if (this->inflightBuffer == NULL && !setInflight(MQTT_MAX_INFLIGHT,MQTT_INFLIGHT_BUFFER_SIZE)) {
+        return false;
+    }
+    if (plength > this->inflightBufferSize) {
+        // Too long
+        return false;
+    }
+    uint8_t fixedHeader[MQTT_MAX_HEADER_SIZE];
+    // With MQTT 5 there is an empty set of properties. Topic aliases are not
+    // used, as the message may be resent on another connection
+    uint32_t length = tlen+2+MQTT_EMPTY_PROPERTIES_SIZE+plength;
+    size_t hlen = buildHeader(header,fixedHeader,length);
+    if (this->inflightCount == this->maxInflight || hlen+length > (uint32_t)(this->inflightBufferSize-this->inflightUsed)) {
+        // No room to hold the message until it is acknowledged
+        return false;
+    }
+#if MQTT_VERSION == MQTT_VERSION_5
+    if (this->inflightCount >= this->serverReceiveMaximum || !withinMaximumPacketSize(length)) {
+        // Not allowed by the server
+        return false;
+    }
+#endif
+
+    // Build the whole packet in the inflight buffer, ready to be resent
+    uint8_t* packet = this->inflightBuffer+this->inflightUsed;
+    uint16_t pos = hlen;
+    memcpy(packet,fixedHeader+(MQTT_MAX_HEADER_SIZE-hlen),hlen);
+    memcpy(packet+pos,topic,tlen);
+    pos += tlen;
+    uint16_t msgId = nextPacketId();
+    packet[pos++] = (msgId >> 8);
+    packet[pos++] = (msgId & 0xFF);
+#if MQTT_VERSION == MQTT_VERSION_5
+    // No properties
+    packet[pos++] = 0;
+#endif
+    memcpy(packet+pos,payload,plength);
+    pos += plength;
+    if (this->store != NULL && !this->store->put(msgId,packet,pos)) {
+        // It could not be kept safe
+        return false;
+    }
+
+    MQTTInflightMessage* message = &this->inflight[this->inflightCount++];
+    message->msgId = msgId;
+    message->length = pos;
+    message->state = (qos == 1)?MQTTPUBACK:MQTTPUBREC;
+    message->sent = millis();
+    this->inflightUsed += pos;
+    this->lastMsgId = msgId;
+
+    // If this fails, the message is sent again once reconnected
+    sendBytes(packet,pos);
+    return true;
+}
+
+// Sends a QoS 0 PUBLISH. With an ExtendedClient the topic and payload are sent
+// from where they are, in one call. Otherwise the topic and properties are copied
+// into the buffer after the header, and the payload follows
+boolean PubSubClient::writePublish(uint8_t header, const uint8_t* topic, uint16_t tlen, const uint8_t* properties, uint8_t propertiesLength, const uint8_t* payload, uint32_t plength) {
+    if (this->_extClient != NULL) {
+        uint8_t fixedHeader[MQTT_MAX_HEADER_SIZE];
+        size_t hlen = buildHeader(header,fixedHeader,tlen+propertiesLength+plength);
+        const uint8_t* buffers[MQTT_MAX_PACKET_PIECES];
+        uint32_t lengths[MQTT_MAX_PACKET_PIECES];
+        uint8_t count = 0;
+        buffers[count] = fixedHeader+(MQTT_MAX_HEADER_SIZE-hlen);
+        lengths[count++] = hlen;
+        buffers[count] = topic;
+        lengths[count++] = tlen;
+        if (propertiesLength > 0) {
+            buffers[count] = properties;
+            lengths[count++] = propertiesLength;
+        }
+        if (plength > 0) {
+            buffers[count] = payload;
+            lengths[count++] = plength;
+        }
+        return sendPacket(buffers,lengths,count);
+    }
+    if (topic != this->txBuffer+MQTT_MAX_HEADER_SIZE) {
+        memcpy(this->txBuffer+MQTT_MAX_HEADER_SIZE,topic,tlen);
+    }
+    if (propertiesLength > 0) {
+        memcpy(this->txBuffer+MQTT_MAX_HEADER_SIZE+tlen,properties,propertiesLength);
+    }
+    // Write the header, with the payload sent from where it is
+    return write(header,this->txBuffer,tlen+propertiesLength,payload,plength);
+}
+
+// Adds a message to the offline queue, making room for it if the policy allows
+boolean PubSubClient::queueOffline(const uint8_t* topic, uint16_t tlen, const uint8_t* payload, uint32_t plength, boolean retained, uint8_t qos) {
+    if (this->offlineQueue == NULL || qos > 2 || this->txBufferSize < MQTT_MAX_HEADER_SIZE + tlen + MQTT_PUBLISH_PROPERTIES_SIZE) {
+        return false;
+    }
+    uint32_t length = 3+tlen+plength;
+    if (length > this->offlineSize) {
+        // Too long
+        return false;
+    }
+    while (true) {
+        if (this->offlineCount == 0) {
+            this->offlineStart = this->offlineEnd = 0;
+        }
+        if (this->offlineCount == 0 || this->offlineEnd > this->offlineStart) {
+            // Free space is after the end, and before the start
+            if (length <= (uint32_t)(this->offlineSize-this->offlineEnd)) {
+                break;
+            }
+            if (length <= this->offlineStart) {
+                // Wrap round. A zero length marks the rest of the queue as unused
+                if (this->offlineSize-this->offlineEnd >= 2) {
+                    this->offlineQueue[this->offlineEnd] = 0;
+                    this->offlineQueue[this->offlineEnd+1] = 0;
+                }
+                this->offlineEnd = 0;
+                break;
+            }
+        } else if (length <= (uint32_t)(this->offlineStart-this->offlineEnd)) {
+            break;
+        }
+        if (this->offlinePolicy != MQTT_QUEUE_DROP_OLDEST) {
+            return false;
+        }
+        dropOffline();
+        this->offlineDropped++;
+    }
+    uint8_t* record = this->offlineQueue+this->offlineEnd;
+    record[0] = (length >> 8);
+    record[1] = (length & 0xFF);
+    record[2] = (qos << 1) | (retained ? 1 : 0);
+    memcpy(record+3,topic,tlen);
+    memcpy(record+3+tlen,payload,plength);
+    this->offlineEnd += length;
+    this->offlineCount++;
+    return true;
+}
+
+// Returns the oldest message in the offline queue, moving the start past any
+// unused space at the end of the queue
+uint8_t* PubSubClient::peekOffline() {
+    if (this->offlineSize-this->offlineStart < 3 || (this->offlineQueue[this->offlineStart] == 0 && this->offlineQueue[this->offlineStart+1] == 0)) {
+        this->offlineStart = 0;
+    }
+    return this->offlineQueue+this->offlineStart;
+}
+
+void PubSubClient::dropOffline() {
+    uint8_t* record = peekOffline();
+    this->offlineStart += (record[0]<<8)+record[1];
+    this->offlineCount--;
+    if (this->offlineCount > 0) {
+        // So the free space is measured from the real start
+        peekOffline();
+    }
+}
+
+// Sends the messages published while disconnected, oldest first, for as long
+// as the connection will take them
+void PubSubClient::flushOffline() {
+    while (this->offlineCount > 0 && connected()) {
+        uint8_t* record = peekOffline();
+        uint16_t length = (record[0]<<8)+record[1];
+        uint8_t qos = (record[2] >> 1) & 0x03;
+        uint16_t tlen = 2+(record[3]<<8)+record[4];
+        this->sendRefused = false;
+        if (!publishEncoded(record+3,tlen,record+3+tlen,length-3-tlen,record[2] & 1,qos)) {
+            if (!connected() || this->sendRefused || this->outUsed > 0 || (qos > 0 && this->inflightCount > 0)) {
+                // Try again once there is room, or once reconnected
+                return;
+            }
+            // It can never be sent
+            this->offlineDropped++;
+        }
+        dropOffline();
+    }
+}
+
+boolean PubSubClient::setOfflineQueue(uint16_t size, uint8_t policy) {
+    release(this->offlineQueue);
+    this->offlineQueue = NULL;
+    this->offlineSize = 0;
+    this->offlineCount = 0;
+    this->offlineDropped = 0;
+    this->offlinePolicy = policy;
+    if (size > 0) {
+        this->offlineQueue = (uint8_t*)allocate(size);
+        if (this->offlineQueue == NULL) {
+            return false;
+        }
+        this->offlineSize = size;
+    }
+    return true;
+}
+
+uint16_t PubSubClient::getOfflineCount() {
+    return this->offlineCount;
+}
+
+uint16_t PubSubClient::getOfflineDropped() {
+    return this->offlineDropped;
+}
+
+TopicHandle PubSubClient::topic(const char* topic) {
+    return TopicHandle(topic,this->allocator);
+}
+
+// Resends the messages that have waited longer than the retry timeout to be
+// acknowledged - or all of them, after reconnecting. MQTT 5 only allows them to
+// be sent again after reconnecting [MQTT-4.4.0-1]
+void PubSubClient::resendInflight(boolean all) {
+#if MQTT_VERSION == MQTT_VERSION_5
+    if (!all) {
+        return;
+    }
+#endif
+    unsigned long t = millis();
+    uint16_t offset = 0;
+    for (uint8_t i = 0; i < this->inflightCount; i++) {
+        MQTTInflightMessage* message = &this->inflight[i];
+        if (all || t - message->sent >= this->retryTimeout*1000UL) {
+            if (message->state == MQTTPUBCOMP) {
+                sendAck(MQTTPUBREL|MQTTQOS1,message->msgId);
+            } else {
+                uint8_t* packet = this->inflightBuffer+offset;
+                uint16_t length = message->length;
+                if (length == 0) {
+                    // Restored from the store, and sent from there
+                    packet = this->store->get(message->msgId,&length);
+                }
+                if (packet != NULL) {
+                    packet[0] |= MQTTDUP;
+                    sendBytes(packet,length);
+                }
+            }
+            message->sent = t;
+        }
+        offset += message->length;
+    }
+}
+
+// Moves an outbound message on when the server acknowledges it. A PUBACK or
+// PUBCOMP completes the message; a PUBREC means the stored packet is no longer
+// needed and is answered with a PUBREL - unless, with MQTT 5, its reason code
+// says the server refused the message, which also completes it
+void PubSubClient::ackInflight(uint8_t type, uint16_t msgId, uint8_t reason) {
+    uint16_t offset = 0;
+    for (uint8_t i = 0; i < this->inflightCount; i++) {
+        MQTTInflightMessage* message = &this->inflight[i];
+        uint16_t length = message->length;
+        if (message->msgId == msgId) {
+            if (type != message->state) {
+                if (type == MQTTPUBREC && message->state == MQTTPUBCOMP) {
+                    // The PUBREL was lost
+                    sendAck(MQTTPUBREL|MQTTQOS1,msgId);
+                }
+                return;
+            }
+            memmove(this->inflightBuffer+offset,this->inflightBuffer+offset+length,this->inflightUsed-offset-length);
+            this->inflightUsed -= length;
+            if (type == MQTTPUBREC && reason < 0x80) {
+                message->length = 0;
+                message->state = MQTTPUBCOMP;
+                message->sent = millis();
+                if (this->store != NULL) {
+                    // Only the PUBREL needs to be sent again now
+                    uint8_t pubrel[4] = {MQTTPUBREL|MQTTQOS1,2,(uint8_t)(msgId >> 8),(uint8_t)(msgId & 0xFF)};
+                    this->store->put(msgId,pubrel,4);
+                }
+                sendAck(MQTTPUBREL|MQTTQOS1,msgId);
+                return;
+            }
+            this->inflightCount--;
+            memmove(message,message+1,(this->inflightCount-i)*sizeof(MQTTInflightMessage));
+            if (this->store != NULL) {
+                this->store->remove(msgId);
+                restoreInflight();
+            }
+            if (publishCallback) {
+                publishCallback(msgId,reason);
+            }
+            return;
+        }
+        offset += length;
+    }
+}
+
+// Takes on messages left in the store by an earlier client, as far as there is
+// room in the inflight table, and sends them again. Their packets stay in the
+// store and are sent from there
+void PubSubClient::restoreInflight() {
+    if (this->store == NULL) {
+        return;
+    }
+    if (this->inflightBuffer == NULL && !setInflight(MQTT_MAX_INFLIGHT,MQTT_INFLIGHT_BUFFER_SIZE)) {
+        return;
+    }
+    uint16_t msgId;
+    uint16_t length;
+    uint8_t* packet;
+    uint8_t limit = this->maxInflight;
+#if MQTT_VERSION == MQTT_VERSION_5
+    if (this->serverReceiveMaximum < limit) {
+        limit = this->serverReceiveMaximum;
+    }
+#endif
+    for (uint16_t i = 0; this->inflightCount < limit && (packet = this->store->item(i,&msgId,&length)) != NULL; i++) {
+        boolean known = false;
+        for (uint8_t j = 0; j < this->inflightCount; j++) {
+            if (this->inflight[j].msgId == msgId) {
+                known = true;
+                break;
+            }
+        }
+        if (known) {
+            continue;
+        }
+        MQTTInflightMessage* message = &this->inflight[this->inflightCount++];
+        message->msgId = msgId;
+        message->length = 0;
+        message->sent = millis();
+        if ((packet[0] & 0xF0) == MQTTPUBREL) {
+            message->state = MQTTPUBCOMP;
+        } else {
+            message->state = ((packet[0] & 0x06) == MQTTQOS1)?MQTTPUBACK:MQTTPUBREC;
+            packet[0] |= MQTTDUP;
+        }
+        sendBytes(packet,length);
+    }
+}
+
+#if MQTT_VERSION == MQTT_VERSION_5
+// Decodes a variable byte integer from the first length bytes of buf.
+// Returns the number of bytes it took, or 0 if it is malformed
+uint8_t PubSubClient::readVarint(const uint8_t* buf, uint32_t length, uint32_t* value) {
+    uint32_t multiplier = 1;
+    *value = 0;
+    for (uint8_t i = 0; i < 4 && i < length; i++) {
+        *value += (buf[i] & 127) * multiplier;
+        if ((buf[i] & 128) == 0) {
+            return i+1;
+        }
+        multiplier <<= 7;
+    }
+    return 0;
+}
+
+// Returns the length of the property at the start of buf, including its
+// identifier, or 0 if it is not a known property or is cut short
+uint32_t PubSubClient::propertyLength(const uint8_t* buf, uint32_t length) {
+    uint32_t size;
+    uint32_t value;
+    switch (buf[0]) {
+    case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+        // Byte
+        size = 2;
+        break;
+    case 0x13: case 0x21: case 0x22: case 0x23:
+        // Two byte integer
+        size = 3;
+        break;
+    case 0x02: case 0x11: case 0x18: case 0x27:
+        // Four byte integer
+        size = 5;
+        break;
+    case 0x0B:
+        // Variable byte integer
+        size = 1+readVarint(buf+1,length-1,&value);
+        if (size == 1) {
+            return 0;
+        }
+        break;
+    case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+        // String or binary data
+        if (length < 3) {
+            return 0;
+        }
+        size = 3+(buf[1]<<8)+buf[2];
+        break;
+    case 0x26:
+        // User property - a pair of strings
+        if (length < 3) {
+            return 0;
+        }
+        size = 3+(buf[1]<<8)+buf[2];
+        if (size+2 > length) {
+            return 0;
+        }
+        size += 2+(buf[size]<<8)+buf[size+1];
+        break;
+    default:
+        return 0;
+    }
+    return (size <= length)?size:0;
+}
+
+// Returns the length of the properties at the start of buf, including the
+// length in front of them, or 0 if they are malformed
+uint32_t PubSubClient::skipProperties(const uint8_t* buf, uint32_t length) {
+    uint32_t properties;
+    uint8_t n = readVarint(buf,length,&properties);
+    if (n == 0 || properties > length-n) {
+        return 0;
+    }
+    return n+properties;
+}
+
+// Takes on the limits the server sets in the properties of its CONNACK
+void PubSubClient::readConnackProperties(const uint8_t* buf, uint32_t length) {
+    uint32_t properties = skipProperties(buf,length);
+    if (properties == 0) {
+        return;
+    }
+    uint32_t value;
+    const uint8_t* p = buf+readVarint(buf,length,&value);
+    const uint8_t* end = buf+properties;
+    while (p < end) {
+        uint32_t size = propertyLength(p,end-p);
+        if (size == 0) {
+            return;
+        }
+        switch (p[0]) {
+        case MQTT_PROP_RECEIVE_MAXIMUM:
+            this->serverReceiveMaximum = (p[1]<<8)+p[2];
+            break;
+        case MQTT_PROP_MAXIMUM_PACKET_SIZE:
+            this->serverMaximumPacketSize = ((uint32_t)p[1]<<24)+((uint32_t)p[2]<<16)+(p[3]<<8)+p[4];
+            break;
+        case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
+            this->topicAliasMaximum = (p[1]<<8)+p[2];
+            if (this->topicAliasMaximum > MQTT_MAX_TOPIC_ALIASES) {
+                this->topicAliasMaximum = MQTT_MAX_TOPIC_ALIASES;
+            }
+            break;
+        case MQTT_PROP_MAXIMUM_QOS:
+            this->serverMaximumQos = p[1];
+            break;
+        case MQTT_PROP_RETAIN_AVAILABLE:
+            this->serverRetainAvailable = p[1];
+            break;
+        case MQTT_PROP_SERVER_KEEP_ALIVE:
+            // The server's keep alive replaces the one asked for, on this
+            // connection only
+            this->connectionKeepAlive = (p[1]<<8)+p[2];
+            break;
+        }
+        p += size;
+    }
+}
+
+// Whether a packet with this remaining length is within the Maximum Packet Size
+// set by the server
+boolean PubSubClient::withinMaximumPacketSize(uint32_t length) {
+    uint8_t llen = 1;
+    for (uint32_t l = length; l > 127; l >>= 7) {
+        llen++;
+    }
+    return 1+llen+length <= this->serverMaximumPacketSize;
+}
+
+// Returns the alias given to the encoded topic on this connection, or 0 if it
+// does not have one
+uint16_t PubSubClient::findTopicAlias(const uint8_t* topic, uint16_t tlen) {
+    for (uint16_t i = 0; i < this->topicAliasCount; i++) {
+        const uint8_t* alias = this->topicAliases[i];
+        // The length prefixes are compared first
+        if (alias[0] == topic[0] && alias[1] == topic[1] && memcmp(alias+2,topic+2,tlen-2) == 0) {
+            return i+1;
+        }
+    }
+    return 0;
+}
+
+void PubSubClient::clearTopicAliases() {
+    for (uint16_t i = 0; i < this->topicAliasCount; i++) {
+        release(this->topicAliases[i]);
+    }
+    this->topicAliasCount = 0;
+    this->topicAliasMaximum = 0;
+}
+#endif
+
+// Sends a PUBACK, PUBREC, PUBREL or PUBCOMP
+boolean PubSubClient::sendAck(uint8_t header, uint16_t msgId) {
+    uint8_t ack[4];
+    ack[0] = header;
+    ack[1] = 2;
+    ack[2] = (msgId >> 8);
+    ack[3] = (msgId & 0xFF);
+    return sendControl(ack,4);
+}
+
+// Returns the position of msgId in the table of QoS 2 messages received from
+// the server, or -1 if it is not there
+int PubSubClient::findIncomingQos2(uint16_t msgId) {
+    for (uint8_t i = 0; i < this->incomingQos2Count; i++) {
+        if (this->incomingQos2[i] == msgId) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Remembers msgId until its PUBREL arrives. Returns false if there is no room
+boolean PubSubClient::addIncomingQos2(uint16_t msgId) {
+    if (this->incomingQos2Count >= MQTT_MAX_INCOMING_QOS2) {
+        return false;
+    }
+    if (this->incomingQos2 == NULL) {
+        this->incomingQos2 = (uint16_t*)allocate(MQTT_MAX_INCOMING_QOS2*sizeof(uint16_t));
+        if (this->incomingQos2 == NULL) {
+            return false;
+        }
+    }
+    this->incomingQos2[this->incomingQos2Count++] = msgId;
+    return true;
+}
+
+// Returns the next message id, skipping 0 and any still in flight
+uint16_t PubSubClient::nextPacketId() {
+    boolean inUse;
+    do {
+        nextMsgId++;
+        if (nextMsgId == 0) {
+            nextMsgId = 1;
+        }
+        inUse = false;
+        for (uint8_t i = 0; i < this->inflightCount; i++) {
+            if (this->inflight[i].msgId == nextMsgId) {
+                inUse = true;
+                break;
+            }
+        }
+        uint16_t length;
+        if (!inUse && this->store != NULL && this->store->get(nextMsgId,&length) != NULL) {
+            // Left by an earlier client, waiting for room to be sent again
+            inUse = true;
+        }
+    } while (inUse);
+    return nextMsgId;
+}
+
+boolean PubSubClient::publish_P(const char* topic, const char* payload, boolean retained) {
+    return publish_P(topic, (const uint8_t*)payload, payload ? strnlen(payload, this->txBufferSize) : 0, retained);
+}
+
+boolean PubSubClient::publish_P(const char* topic, const uint8_t* payload, uint32_t plength, boolean retained) {
+    uint8_t digit;
+    uint16_t tlen;
+    unsigned int pos = 0;
+    uint32_t i;
+    uint32_t n;
+    uint8_t header;
+    uint32_t len;
+    // The payload is in program memory, so it is copied out a piece at a time
+    uint8_t chunk[MQTT_PROGMEM_CHUNK_SIZE];
+
+    if (!connected()) {
+        return false;
+    }
+
+    tlen = strnlen(topic, this->txBufferSize);
+    if (plength > MQTT_MAX_REMAINING_LENGTH - 2-tlen) {
+        // Too long
+        return false;
+    }
+
+    header = MQTTPUBLISH;
+    if (retained) {
+        header |= 1;
+    }
+    this->txBuffer[pos++] = header;
+    len = plength + 2 + tlen + MQTT_EMPTY_PROPERTIES_SIZE;
+    do {
         digit = len  & 127; //digit = len %128
         len >>= 7; //len = len / 128
         if (len > 0) {
             digit |= 0x80;
         }
-        this->buffer[pos++] = digit;
-        llen++;
+        this->txBuffer[pos++] = digit;
     } while(len>0);
 
-    pos = writeString(topic,this->buffer,pos);
-
-    rc += _client->write(this->buffer,pos);
+    pos = writeString(topic,this->txBuffer,pos);
+#if MQTT_VERSION == MQTT_VERSION_5
+    // No properties
+    this->txBuffer[pos++] = 0;
+#endif
 
-    for (i=0;i<plength;i++) {
-        rc += _client->write((char)pgm_read_byte_near(payload + i));
+    // As sendPacket(), the packet goes out whole and in order or not at all
+    uint32_t total = pos+plength;
+    if (this->outUsed > 0 && (!this->corked || total > this->outSize-this->outUsed)) {
+        flushOutbound();
+    }
+    uint32_t sent = 0;
+    if (this->outUsed == 0 && (!this->corked || total > this->outSize)) {
+        // Send it straight away, for as long as the client takes all it is given
+        sent = writeBytes(this->txBuffer,pos);
+        for (i = 0; sent == pos+i && i < plength; i += n) {
+            n = (plength-i < MQTT_PROGMEM_CHUNK_SIZE)?plength-i:MQTT_PROGMEM_CHUNK_SIZE;
+            for (uint32_t j = 0; j < n; j++) {
+                chunk[j] = pgm_read_byte_near(payload + i + j);
+            }
+            sent += writeBytes(chunk,n);
+        }
+        if (sent == total) {
+            lastOutActivity = millis();
+            return true;
+        }
+        if (sent == 0 && total > this->outSize) {
+            // Nothing has gone, so the caller can simply try again later
+            this->sendRefused = true;
+            return false;
+        }
+        // The rest has to follow what has gone, so the buffer grows to hold it if it must
+        if (!growOutbound(total-sent)) {
+            abortConnection();
+            return false;
+        }
+    } else if (total > this->outSize-this->outUsed) {
+        // Sending it now would put it ahead of the bytes still waiting
+        this->sendRefused = true;
+        return false;
+    }
+    // Hold back whatever has not gone. There is room for all of it, so once the
+    // buffer exists nothing can fail part way
+    if (sent < pos && !queueOutbound(this->txBuffer+sent,pos-sent)) {
+        return false;
+    }
+    for (i = (sent > pos)?sent-pos:0; i < plength; i += n) {
+        n = (plength-i < MQTT_PROGMEM_CHUNK_SIZE)?plength-i:MQTT_PROGMEM_CHUNK_SIZE;
+        for (uint32_t j = 0; j < n; j++) {
+            chunk[j] = pgm_read_byte_near(payload + i + j);
+        }
+        queueOutbound(chunk,n);
     }
-
     lastOutActivity = millis();
-
-    expectedLength = 1 + llen + 2 + tlen + plength;
-
-    return (rc == expectedLength);
+    return true;
 }
 
-boolean PubSubClient::beginPublish(const char* topic, unsigned int plength, boolean retained) {
+boolean PubSubClient::beginPublish(const char* topic, uint32_t plength, boolean retained) {
     if (connected()) {
-        // Send the header and variable length field
-        uint16_t length = MQTT_MAX_HEADER_SIZE;
-        length = writeString(topic,this->buffer,length);
-        uint8_t header = MQTTPUBLISH;
-        if (retained) {
-            header |= 1;
+        size_t tlen = strnlen(topic, this->txBufferSize);
+        if (this->txBufferSize < MQTT_MAX_HEADER_SIZE + 2+tlen) {
+            // Too long
+            return false;
         }
-        size_t hlen = buildHeader(header, this->buffer, plength+length-MQTT_MAX_HEADER_SIZE);
-        uint16_t rc = _client->write(this->buffer+(MQTT_MAX_HEADER_SIZE-hlen),length-(MQTT_MAX_HEADER_SIZE-hlen));
-        lastOutActivity = millis();
-        return (rc == (length-(MQTT_MAX_HEADER_SIZE-hlen)));
+        writeString(topic,this->txBuffer,MQTT_MAX_HEADER_SIZE);
+        return beginPublishEncoded(2+tlen,plength,retained);
     }
     return false;
 }
 
+boolean PubSubClient::beginPublish(const TopicHandle& topic, uint32_t plength, boolean retained) {
+    if (!topic.valid() || !connected() || this->txBufferSize < MQTT_MAX_HEADER_SIZE + topic.length()) {
+        return false;
+    }
+    memcpy(this->txBuffer+MQTT_MAX_HEADER_SIZE,topic.bytes(),topic.length());
+    return beginPublishEncoded(topic.length(),plength,retained);
+}
+
+// Sends the header and the encoded topic, which is already in the buffer
+boolean PubSubClient::beginPublishEncoded(uint16_t tlen, uint32_t plength, boolean retained) {
+#if MQTT_VERSION == MQTT_VERSION_5
+    if (this->txBufferSize < MQTT_MAX_HEADER_SIZE + tlen + 1 || (retained && !this->serverRetainAvailable)) {
+        return false;
+    }
+    // No properties
+    this->txBuffer[MQTT_MAX_HEADER_SIZE+tlen++] = 0;
+    if (!withinMaximumPacketSize(tlen+plength)) {
+        return false;
+    }
+#endif
+    if (plength > MQTT_MAX_REMAINING_LENGTH - tlen) {
+        // Too long
+        return false;
+    }
+    uint8_t header = MQTTPUBLISH;
+    if (retained) {
+        header |= 1;
+    }
+    size_t hlen = buildHeader(header, this->txBuffer, plength+tlen);
+    return sendBytes(this->txBuffer+(MQTT_MAX_HEADER_SIZE-hlen),hlen+tlen);
+}
+
 int PubSubClient::endPublish() {
  return 1;
 }
 
 size_t PubSubClient::write(uint8_t data) {
-    lastOutActivity = millis();
-    return _client->write(data);
+    return write(&data,1);
 }
 
+// Passes as much of the payload to the client as it will take and holds back as
+// much of the rest as fits in the outbound buffer. The caller passes what is left
+// again once flush() or onWritable() has made room
 size_t PubSubClient::write(const uint8_t *buffer, size_t size) {
-    lastOutActivity = millis();
-    return _client->write(buffer,size);
+    if (this->outUsed > 0) {
+        flushOutbound();
+    }
+    size_t sent = 0;
+    if (this->outUsed == 0 && !this->corked) {
+        sent = writeBytes(buffer,size);
+    }
+    size_t held = size-sent;
+    if (held > this->outSize-this->outUsed) {
+        held = this->outSize-this->outUsed;
+    }
+    if (!queueOutbound(buffer+sent,held)) {
+        held = 0;
+    }
+    if (sent+held > 0) {
+        lastOutActivity = millis();
+    }
+    return sent+held;
 }
 
-size_t PubSubClient::buildHeader(uint8_t header, uint8_t* buf, uint16_t length) {
+size_t PubSubClient::buildHeader(uint8_t header, uint8_t* buf, uint32_t length) {
     uint8_t lenBuf[4];
     uint8_t llen = 0;
     uint8_t digit;
     uint8_t pos = 0;
-    uint16_t len = length;
+    uint32_t len = length;
     do {
 
         digit = len  & 127; //digit = len %128
@@ -571,34 +1764,254 @@ size_t PubSubClient::buildHeader(uint8_t header, uint8_t* buf, uint16_t length)
         llen++;
     } while(len>0);
 
-    buf[4-llen] = header;
-    for (int i=0;i<llen;i++) {
-        buf[MQTT_MAX_HEADER_SIZE-llen+i] = lenBuf[i];
+    buf[4-llen] = header;
+    for (int i=0;i<llen;i++) {
+        buf[MQTT_MAX_HEADER_SIZE-llen+i] = lenBuf[i];
+    }
+    return llen+1; // Full header size is variable length bit plus the 1-byte fixed header
+}
+
+boolean PubSubClient::write(uint8_t header, uint8_t* buf, uint16_t length) {
+    uint8_t hlen = buildHeader(header, buf, length);
+    return sendBytes(buf+(MQTT_MAX_HEADER_SIZE-hlen),length+hlen);
+}
+
+// Sends the packet in buf followed by a payload held elsewhere. A small payload is
+// copied into the buffer so the packet goes in one write, otherwise it is passed
+// straight to the client - in the same call if the client supports it.
+boolean PubSubClient::write(uint8_t header, uint8_t* buf, uint16_t length, const uint8_t* payload, uint32_t plength) {
+    if (this->_extClient == NULL && MQTT_MAX_HEADER_SIZE+length+plength <= this->txBufferSize) {
+        memcpy(buf+MQTT_MAX_HEADER_SIZE+length,payload,plength);
+        return write(header,buf,length+plength);
+    }
+    uint8_t hlen = buildHeader(header, buf, length+plength);
+    return sendPacket(buf+(MQTT_MAX_HEADER_SIZE-hlen),hlen+length,payload,plength);
+}
+
+boolean PubSubClient::sendBytes(const uint8_t* buf, uint32_t length) {
+    return sendPacket(buf,length,NULL,0);
+}
+
+// Sends an acknowledgement or a PINGRESP. Nothing sends these again, so unlike
+// other packets they are never refused: when the outbound buffer is full they
+// are added to the end anyway, growing it. If there is no memory for that the
+// connection cannot carry on, so it is dropped
+boolean PubSubClient::sendControl(const uint8_t* buf, uint32_t length) {
+    if (this->outUsed > 0 && length > this->outSize-this->outUsed) {
+        flushOutbound();
+    }
+    if (this->outUsed > 0 && length > this->outSize-this->outUsed) {
+        if (!growOutbound(length) || !queueOutbound(buf,length)) {
+            abortConnection();
+            return false;
+        }
+        lastOutActivity = millis();
+        return true;
+    }
+    return sendBytes(buf,length);
+}
+
+boolean PubSubClient::sendPacket(const uint8_t* buf, uint32_t length, const uint8_t* payload, uint32_t plength) {
+    const uint8_t* buffers[2] = {buf,payload};
+    uint32_t lengths[2] = {length,plength};
+    return sendPacket(buffers,lengths,(plength > 0)?2:1);
+}
+
+// Sends a packet made of count pieces, one after the other. Whatever the client
+// does not take straight away, and everything sent while corked, is held in the
+// outbound buffer and sent by later calls and by loop(), so packets always go out
+// whole and in order. Returns false, with nothing sent, if there is no room to hold
+// the packet; the caller can try again once flush() or onWritable() has made room
+boolean PubSubClient::sendPacket(const uint8_t* const* buffers, const uint32_t* lengths, uint8_t count) {
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        total += lengths[i];
+    }
+    if (this->outUsed > 0 && (!this->corked || total > this->outSize-this->outUsed)) {
+        flushOutbound();
+    }
+    if (this->outUsed > 0 || this->corked) {
+        if (total <= this->outSize-this->outUsed && queueOutbound(buffers[0],lengths[0])) {
+            for (uint8_t i = 1; i < count; i++) {
+                queueOutbound(buffers[i],lengths[i]);
+            }
+            lastOutActivity = millis();
+            return true;
+        }
+        if (this->outUsed > 0) {
+            // Sending it now would put it ahead of the bytes still waiting
+            this->sendRefused = true;
+            return false;
+        }
+        // Too big to hold back, but nothing is waiting so it can go now
+    }
+    uint32_t rc = 0;
+    if (this->_extClient != NULL && count > 1) {
+        size_t sizes[MQTT_MAX_PACKET_PIECES];
+        for (uint8_t i = 0; i < count; i++) {
+            sizes[i] = lengths[i];
+        }
+        rc = this->_extClient->writev(buffers,sizes,count);
+    } else {
+        for (uint8_t i = 0; i < count; i++) {
+            uint32_t n = writeBytes(buffers[i],lengths[i]);
+            rc += n;
+            if (n < lengths[i]) {
+                break;
+            }
+        }
+    }
+    if (rc == 0 && total > this->outSize) {
+        // Nothing has gone, so the caller can simply try again later
+        this->sendRefused = true;
+        return false;
+    }
+    if (rc < total) {
+        // Keep the rest to send later. Once part of the packet has gone the rest
+        // has to follow, so the buffer grows to hold it if it must
+        boolean queued = growOutbound(total-rc);
+        uint32_t skip = rc;
+        for (uint8_t i = 0; queued && i < count; i++) {
+            if (skip >= lengths[i]) {
+                skip -= lengths[i];
+            } else {
+                queued = queueOutbound(buffers[i]+skip,lengths[i]-skip);
+                skip = 0;
+            }
+        }
+        if (!queued) {
+            // There is no memory to hold the rest, so the connection cannot be used
+            abortConnection();
+            return false;
+        }
+    }
+    lastOutActivity = millis();
+    return true;
+}
+
+// Makes room for length more bytes in the outbound buffer, moving what is there
+// to a larger block if needed. The buffer shrinks back once it has been sent
+boolean PubSubClient::growOutbound(uint32_t length) {
+    if (length <= this->outSize-this->outUsed) {
+        return true;
+    }
+    uint32_t size = this->outUsed+length;
+    uint8_t* grown = (uint8_t*)allocate(size);
+    if (grown == NULL) {
+        return false;
+    }
+    uint32_t n = this->outSize-this->outHead;
+    if (n > this->outUsed) {
+        n = this->outUsed;
+    }
+    if (this->outBuffer != NULL) {
+        memcpy(grown,this->outBuffer+this->outHead,n);
+        memcpy(grown+n,this->outBuffer,this->outUsed-n);
+        release(this->outBuffer);
+    }
+    this->outBuffer = grown;
+    this->outSize = size;
+    this->outHead = 0;
+    return true;
+}
+
+// Adds bytes to the end of the outbound ring buffer
+boolean PubSubClient::queueOutbound(const uint8_t* buf, uint32_t length) {
+    if (length == 0) {
+        return true;
+    }
+    if (this->outBuffer == NULL) {
+        this->outBuffer = (uint8_t*)allocate(this->outSize);
+        if (this->outBuffer == NULL) {
+            return false;
+        }
+    }
+    if (length > this->outSize-this->outUsed) {
+        return false;
+    }
+    uint32_t tail = (this->outHead+this->outUsed)%this->outSize;
+    uint32_t n = this->outSize-tail;
+    if (n > length) {
+        n = length;
+    }
+    memcpy(this->outBuffer+tail,buf,n);
+    memcpy(this->outBuffer,buf+n,length-n);
+    this->outUsed += length;
+    return true;
+}
+
+// Sends as much of the outbound buffer as the client will take.
+// Returns true once it is empty
+boolean PubSubClient::flushOutbound() {
+    while (this->outUsed > 0) {
+        uint32_t n = this->outSize-this->outHead;
+        if (n > this->outUsed) {
+            n = this->outUsed;
+        }
+        uint32_t rc = writeBytes(this->outBuffer+this->outHead,n);
+        this->outHead = (this->outHead+rc)%this->outSize;
+        this->outUsed -= rc;
+        if (rc < n) {
+            return false;
+        }
+    }
+    this->outHead = 0;
+    if (this->outSize > MQTT_OUTBOUND_BUFFER_SIZE) {
+        // It grew to hold the rest of a large packet
+        release(this->outBuffer);
+        this->outBuffer = NULL;
+        this->outSize = MQTT_OUTBOUND_BUFFER_SIZE;
+    }
+    return true;
+}
+
+// Drops a connection whose outbound stream has been cut part way through a packet
+void PubSubClient::abortConnection() {
+    this->outHead = 0;
+    this->outUsed = 0;
+    _state = MQTT_CONNECTION_LOST;
+    _client->stop();
+}
+
+boolean PubSubClient::cork() {
+    if (this->outBuffer == NULL) {
+        this->outBuffer = (uint8_t*)allocate(this->outSize);
+        if (this->outBuffer == NULL) {
+            return false;
+        }
     }
-    return llen+1; // Full header size is variable length bit plus the 1-byte fixed header
+    this->corked = true;
+    return true;
 }
 
-boolean PubSubClient::write(uint8_t header, uint8_t* buf, uint16_t length) {
-    uint16_t rc;
-    uint8_t hlen = buildHeader(header, buf, length);
+void PubSubClient::uncork() {
+    this->corked = false;
+    flushOutbound();
+}
+
+void PubSubClient::flush() {
+    flushOutbound();
+}
 
+// Passes bytes to the client, stopping if it does not take them all.
+// Returns the number of bytes it took
+uint32_t PubSubClient::writeBytes(const uint8_t* buf, uint32_t length) {
 #ifdef MQTT_MAX_TRANSFER_SIZE
-    uint8_t* writeBuf = buf+(MQTT_MAX_HEADER_SIZE-hlen);
-    uint16_t bytesRemaining = length+hlen;  //Match the length type
+    const uint8_t* writeBuf = buf;
+    uint32_t bytesRemaining = length;
     uint8_t bytesToWrite;
-    boolean result = true;
-    while((bytesRemaining > 0) && result) {
+    while (bytesRemaining > 0) {
         bytesToWrite = (bytesRemaining > MQTT_MAX_TRANSFER_SIZE)?MQTT_MAX_TRANSFER_SIZE:bytesRemaining;
-        rc = _client->write(writeBuf,bytesToWrite);
-        result = (rc == bytesToWrite);
+        uint32_t rc = _client->write(writeBuf,bytesToWrite);
         bytesRemaining -= rc;
         writeBuf += rc;
+        if (rc < bytesToWrite) {
+            break;
+        }
     }
-    return result;
+    return length-bytesRemaining;
 #else
-    rc = _client->write(buf+(MQTT_MAX_HEADER_SIZE-hlen),length+hlen);
-    lastOutActivity = millis();
-    return (rc == hlen+length);
+    return _client->write(buf,length);
 #endif
 }
 
@@ -607,60 +2020,316 @@ boolean PubSubClient::subscribe(const char* topic) {
 }
 
 boolean PubSubClient::subscribe(const char* topic, uint8_t qos) {
-    size_t topicLength = strnlen(topic, this->bufferSize);
+    size_t topicLength = strnlen(topic, this->txBufferSize);
     if (topic == 0) {
         return false;
     }
-    if (qos > 1) {
+    if (qos > 2) {
         return false;
     }
-    if (this->bufferSize < 9 + topicLength) {
+    if (this->txBufferSize < 9 + MQTT_EMPTY_PROPERTIES_SIZE + topicLength) {
         // Too long
         return false;
     }
     if (connected()) {
         // Leave room in the buffer for header and variable length field
         uint16_t length = MQTT_MAX_HEADER_SIZE;
-        nextMsgId++;
-        if (nextMsgId == 0) {
-            nextMsgId = 1;
+        uint16_t msgId = nextPacketId();
+        this->txBuffer[length++] = (msgId >> 8);
+        this->txBuffer[length++] = (msgId & 0xFF);
+#if MQTT_VERSION == MQTT_VERSION_5
+        // No properties
+        this->txBuffer[length++] = 0;
+#endif
+        length = writeString((char*)topic, this->txBuffer,length);
+        this->txBuffer[length++] = qos;
+        if (!write(MQTTSUBSCRIBE|MQTTQOS1,this->txBuffer,length-MQTT_MAX_HEADER_SIZE)) {
+            return false;
         }
-        this->buffer[length++] = (nextMsgId >> 8);
-        this->buffer[length++] = (nextMsgId & 0xFF);
-        length = writeString((char*)topic, this->buffer,length);
-        this->buffer[length++] = qos;
-        return write(MQTTSUBSCRIBE|MQTTQOS1,this->buffer,length-MQTT_MAX_HEADER_SIZE);
+        trackSubscription(msgId);
+        return true;
     }
     return false;
 }
 
+boolean PubSubClient::subscribe(const char* topic, uint8_t qos, MQTT_HANDLER_SIGNATURE) {
+    if (topic == 0 || !connected()) {
+        return false;
+    }
+    // A handler already set for the filter is only replaced once the SUBSCRIBE
+    // has gone, so a failed call leaves it as it was
+    boolean added = !hasHandler(topic);
+    if (added && !addHandler(topic,handler)) {
+        return false;
+    }
+    if (!subscribe(topic,qos)) {
+        if (added) {
+            removeHandler(&this->topicTrie,topic);
+        }
+        return false;
+    }
+    if (!added) {
+        addHandler(topic,handler);
+    }
+    return true;
+}
+
 boolean PubSubClient::unsubscribe(const char* topic) {
-	size_t topicLength = strnlen(topic, this->bufferSize);
+	size_t topicLength = strnlen(topic, this->txBufferSize);
     if (topic == 0) {
         return false;
     }
-    if (this->bufferSize < 9 + topicLength) {
+    if (this->txBufferSize < 9 + MQTT_EMPTY_PROPERTIES_SIZE + topicLength) {
         // Too long
         return false;
     }
     if (connected()) {
         uint16_t length = MQTT_MAX_HEADER_SIZE;
-        nextMsgId++;
-        if (nextMsgId == 0) {
-            nextMsgId = 1;
+        uint16_t msgId = nextPacketId();
+        this->txBuffer[length++] = (msgId >> 8);
+        this->txBuffer[length++] = (msgId & 0xFF);
+#if MQTT_VERSION == MQTT_VERSION_5
+        // No properties
+        this->txBuffer[length++] = 0;
+#endif
+        length = writeString(topic, this->txBuffer,length);
+        if (!write(MQTTUNSUBSCRIBE|MQTTQOS1,this->txBuffer,length-MQTT_MAX_HEADER_SIZE)) {
+            return false;
+        }
+        trackSubscription(msgId);
+        removeHandler(&this->topicTrie,topic);
+        return true;
+    }
+    return false;
+}
+
+boolean PubSubClient::subscribe(const char* const* topics, const uint8_t* qos, size_t count) {
+    if (qos == NULL) {
+        return false;
+    }
+    return writeSubscriptions(MQTTSUBSCRIBE|MQTTQOS1,topics,qos,count);
+}
+
+boolean PubSubClient::unsubscribe(const char* const* topics, size_t count) {
+    if (!writeSubscriptions(MQTTUNSUBSCRIBE|MQTTQOS1,topics,NULL,count)) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        removeHandler(&this->topicTrie,topics[i]);
+    }
+    return true;
+}
+
+// Sends count topic filters in as few SUBSCRIBE or UNSUBSCRIBE packets as the
+// buffer allows. qos is NULL for an UNSUBSCRIBE, which has no qos byte
+boolean PubSubClient::writeSubscriptions(uint8_t header, const char* const* topics, const uint8_t* qos, size_t count) {
+    if (topics == NULL || count == 0 || !connected()) {
+        return false;
+    }
+    // Each filter is a length, the topic and, to subscribe, the qos
+    uint8_t overhead = qos ? 3 : 2;
+    // The message id and the properties
+    uint8_t variableHeader = 2+MQTT_EMPTY_PROPERTIES_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        if (topics[i] == NULL || (qos && qos[i] > 2)) {
+            return false;
+        }
+        if (MQTT_MAX_HEADER_SIZE+variableHeader+overhead+strnlen(topics[i], this->txBufferSize) > this->txBufferSize) {
+            // Too long to fit in a packet on its own
+            return false;
+        }
+    }
+    size_t i = 0;
+    while (i < count) {
+        uint16_t length = MQTT_MAX_HEADER_SIZE;
+        uint16_t msgId = nextPacketId();
+        this->txBuffer[length++] = (msgId >> 8);
+        this->txBuffer[length++] = (msgId & 0xFF);
+#if MQTT_VERSION == MQTT_VERSION_5
+        // No properties
+        this->txBuffer[length++] = 0;
+#endif
+        while (i < count && length+overhead+strnlen(topics[i], this->txBufferSize) <= this->txBufferSize) {
+            length = writeString(topics[i],this->txBuffer,length);
+            if (qos) {
+                this->txBuffer[length++] = qos[i];
+            }
+            i++;
+        }
+        if (!write(header,this->txBuffer,length-MQTT_MAX_HEADER_SIZE)) {
+            return false;
+        }
+        trackSubscription(msgId);
+    }
+    return true;
+}
+
+// Sets the handler for a topic filter, adding trie nodes for any levels not
+// already there
+boolean PubSubClient::addHandler(const char* filter, MQTT_HANDLER_SIGNATURE) {
+    MQTTTopicNode** link = &this->topicTrie;
+    // Where the first node this call adds is linked in. Everything below it is
+    // new too, so it can all be taken out again
+    MQTTTopicNode** added = NULL;
+    const char* level = filter;
+    while (true) {
+        const char* end = strchr(level,'/');
+        uint16_t length = end ? end-level : strlen(level);
+        MQTTTopicNode* node = *link;
+        while (node && !(node->length == length && memcmp(node->level,level,length) == 0)) {
+            node = node->next;
+        }
+        if (node == NULL) {
+            node = newTopicNode(this->allocator,level,length);
+            if (node == NULL) {
+                if (added != NULL) {
+                    // Don't leave the levels above behind with no handler
+                    MQTTTopicNode* first = *added;
+                    *added = first->next;
+                    first->next = NULL;
+                    freeTopicNodes(this->allocator,first);
+                }
+                return false;
+            }
+            node->next = *link;
+            *link = node;
+            if (added == NULL) {
+                added = link;
+            }
+        }
+        if (end == NULL) {
+            node->handler = handler;
+            return true;
+        }
+        link = &node->child;
+        level = end+1;
+    }
+}
+
+// Whether a handler is set for exactly this topic filter
+boolean PubSubClient::hasHandler(const char* filter) {
+    MQTTTopicNode* node = this->topicTrie;
+    const char* level = filter;
+    while (node) {
+        const char* end = strchr(level,'/');
+        uint16_t length = end ? end-level : strlen(level);
+        while (node && !(node->length == length && memcmp(node->level,level,length) == 0)) {
+            node = node->next;
+        }
+        if (node == NULL) {
+            return false;
+        }
+        if (end == NULL) {
+            return node->handler != NULL;
+        }
+        node = node->child;
+        level = end+1;
+    }
+    return false;
+}
+
+// Clears the handler for a topic filter, removing any nodes left with nothing
+// below them. Returns true if the node at *link was removed
+boolean PubSubClient::removeHandler(MQTTTopicNode** link, const char* filter) {
+    const char* end = strchr(filter,'/');
+    uint16_t length = end ? end-filter : strlen(filter);
+    while (*link) {
+        MQTTTopicNode* node = *link;
+        if (node->length == length && memcmp(node->level,filter,length) == 0) {
+            if (end) {
+                removeHandler(&node->child,end+1);
+            } else {
+                node->handler = NULL;
+            }
+            if (node->handler || node->child) {
+                return false;
+            }
+            *link = node->next;
+            deleteTopicNode(this->allocator,node);
+            return true;
         }
-        this->buffer[length++] = (nextMsgId >> 8);
-        this->buffer[length++] = (nextMsgId & 0xFF);
-        length = writeString(topic, this->buffer,length);
-        return write(MQTTUNSUBSCRIBE|MQTTQOS1,this->buffer,length-MQTT_MAX_HEADER_SIZE);
+        link = &node->next;
     }
     return false;
 }
 
+// Calls the handler of every filter that matches topic, working down the trie one
+// topic level at a time from level. Returns true if any handler was called
+boolean PubSubClient::dispatch(MQTTTopicNode* node, char* topic, const char* level, uint8_t* payload, unsigned int plength) {
+    const char* end = strchr(level,'/');
+    uint16_t length = end ? end-level : strlen(level);
+    // Wildcards do not match topics beginning with $, such as $SYS
+    boolean wildcards = !(level == topic && topic[0] == '$');
+    boolean matched = false;
+    for (; node; node = node->next) {
+        boolean wildcard = wildcards && node->length == 1;
+        if (wildcard && node->level[0] == '#') {
+            // Matches this level and everything below it
+            if (node->handler) {
+                node->handler(topic,payload,plength);
+                matched = true;
+            }
+        } else if ((wildcard && node->level[0] == '+') || (node->length == length && memcmp(node->level,level,length) == 0)) {
+            if (end) {
+                matched |= dispatch(node->child,topic,end+1,payload,plength);
+            } else {
+                if (node->handler) {
+                    node->handler(topic,payload,plength);
+                    matched = true;
+                }
+                // A filter ending in # also matches its parent level
+                for (MQTTTopicNode* child = node->child; child; child = child->next) {
+                    if (child->length == 1 && child->level[0] == '#' && child->handler) {
+                        child->handler(topic,payload,plength);
+                        matched = true;
+                    }
+                }
+            }
+        }
+    }
+    return matched;
+}
+
+// Records a SUBSCRIBE or UNSUBSCRIBE as waiting for its acknowledgement
+void PubSubClient::trackSubscription(uint16_t msgId) {
+    this->lastMsgId = msgId;
+    if (this->subscriptions == NULL) {
+        this->subscriptions = (MQTTSubscribeStatus*)allocate(MQTT_MAX_SUBSCRIBE_STATUS*sizeof(MQTTSubscribeStatus));
+        if (this->subscriptions == NULL) {
+            // Sent all the same; its result just cannot be read back
+            return;
+        }
+    }
+    this->subscriptions[this->subscriptionNext].msgId = msgId;
+    this->subscriptions[this->subscriptionNext].status = MQTT_SUBSCRIBE_PENDING;
+    this->subscriptionNext = (this->subscriptionNext+1)%MQTT_MAX_SUBSCRIBE_STATUS;
+    if (this->subscriptionCount < MQTT_MAX_SUBSCRIBE_STATUS) {
+        this->subscriptionCount++;
+    }
+}
+
+MQTTSubscribeStatus* PubSubClient::findSubscription(uint16_t msgId) {
+    for (uint8_t i = 0; i < this->subscriptionCount; i++) {
+        if (this->subscriptions[i].msgId == msgId) {
+            return &this->subscriptions[i];
+        }
+    }
+    return NULL;
+}
+
+uint8_t PubSubClient::subscribeStatus(uint16_t msgId) {
+    MQTTSubscribeStatus* status = findSubscription(msgId);
+    if (status == NULL) {
+        return MQTT_SUBSCRIBE_UNKNOWN;
+    }
+    return status->status;
+}
+
 void PubSubClient::disconnect() {
-    this->buffer[0] = MQTTDISCONNECT;
-    this->buffer[1] = 0;
-    _client->write(this->buffer,2);
+    this->reconnectWanted = false;
+    this->reconnectPending = false;
+    sendBytes(DISCONNECT_PACKET,2);
+    flushOutbound();
     _state = MQTT_DISCONNECTED;
     _client->flush();
     _client->stop();
@@ -723,8 +2392,47 @@ PubSubClient& PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE) {
     return *this;
 }
 
+PubSubClient& PubSubClient::setRawCallback(MQTT_RAW_CALLBACK_SIGNATURE) {
+    this->rawCallback = rawCallback;
+    return *this;
+}
+
+PubSubClient& PubSubClient::setChunkCallbacks(MQTT_MESSAGE_BEGIN_SIGNATURE, MQTT_MESSAGE_CHUNK_SIGNATURE, MQTT_MESSAGE_END_SIGNATURE) {
+    this->messageBegin = messageBegin;
+    this->messageChunk = messageChunk;
+    this->messageEnd = messageEnd;
+    return *this;
+}
+
+PubSubClient& PubSubClient::setConnectCallback(MQTT_CONNECT_CALLBACK_SIGNATURE) {
+    this->connectCallback = connectCallback;
+    return *this;
+}
+
+PubSubClient& PubSubClient::setPublishCallback(MQTT_PUBLISH_CALLBACK_SIGNATURE) {
+    this->publishCallback = publishCallback;
+    return *this;
+}
+
+PubSubClient& PubSubClient::setSubscribeCallback(MQTT_SUBSCRIBE_CALLBACK_SIGNATURE) {
+    this->subscribeCallback = subscribeCallback;
+    return *this;
+}
+
+PubSubClient& PubSubClient::setUnsubscribeCallback(MQTT_UNSUBSCRIBE_CALLBACK_SIGNATURE) {
+    this->unsubscribeCallback = unsubscribeCallback;
+    return *this;
+}
+
 PubSubClient& PubSubClient::setClient(Client& client){
     this->_client = &client;
+    this->_extClient = NULL;
+    return *this;
+}
+
+PubSubClient& PubSubClient::setClient(ExtendedClient& client){
+    this->_client = &client;
+    this->_extClient = &client;
     return *this;
 }
 
@@ -742,23 +2450,220 @@ boolean PubSubClient::setBufferSize(uint16_t size) {
         // Cannot set it back to 0
         return false;
     }
-    if (this->bufferSize == 0) {
-        this->buffer = (uint8_t*)malloc(size);
+    if (this->bufferFixed) {
+        // Cannot grow
+        if (size > this->bufferCapacity) {
+            return false;
+        }
+        this->bufferSize = size;
     } else {
-        uint8_t* newBuffer = (uint8_t*)realloc(this->buffer, size);
-        if (newBuffer != NULL) {
-            this->buffer = newBuffer;
-        } else {
+        // Nothing in the buffer is kept between packets, so a new buffer replaces
+        // the old one without copying it
+        uint8_t* newBuffer = (uint8_t*)allocate(size);
+        if (newBuffer == NULL) {
+            return false;
+        }
+        if (this->bufferSize != 0) {
+            release(this->buffer);
+        }
+        this->buffer = newBuffer;
+        this->bufferSize = size;
+    }
+    if (!this->txSeparate) {
+        this->txBuffer = this->buffer;
+        this->txBufferSize = this->bufferSize;
+    }
+    return true;
+}
+
+boolean PubSubClient::setBufferSize(uint16_t rxSize, uint16_t txSize) {
+    if (txSize == 0) {
+        // Share the receive buffer again
+        if (!setBufferSize(rxSize)) {
             return false;
         }
+        if (this->txSeparate) {
+            release(this->txBuffer);
+            this->txSeparate = false;
+        }
+        this->txBuffer = this->buffer;
+        this->txBufferSize = this->bufferSize;
+        return true;
+    }
+    // Allocated first, so nothing changes if it cannot be
+    uint8_t* newTxBuffer = (uint8_t*)allocate(txSize);
+    if (newTxBuffer == NULL) {
+        return false;
+    }
+    boolean wasSeparate = this->txSeparate;
+    // Stops setBufferSize() pointing the transmit buffer at the new receive buffer
+    this->txSeparate = true;
+    if (!setBufferSize(rxSize)) {
+        this->txSeparate = wasSeparate;
+        release(newTxBuffer);
+        return false;
+    }
+    if (wasSeparate) {
+        release(this->txBuffer);
+    }
+    this->txBuffer = newTxBuffer;
+    this->txBufferSize = txSize;
+    return true;
+}
+
+boolean PubSubClient::setBuffer(uint8_t* mem, uint16_t size) {
+    if (mem == NULL || size == 0) {
+        return false;
     }
+    if (!this->bufferFixed && this->bufferSize != 0) {
+        release(this->buffer);
+    }
+    this->buffer = mem;
     this->bufferSize = size;
-    return (this->buffer != NULL);
+    this->bufferCapacity = size;
+    this->bufferFixed = true;
+    if (!this->txSeparate) {
+        this->txBuffer = mem;
+        this->txBufferSize = size;
+    }
+    return true;
+}
+
+boolean PubSubClient::setAllocator(MQTTAllocator& allocator) {
+    // Everything is moved, or nothing is
+    void** blocks[] = {
+        (void**)&this->buffer,
+        (void**)&this->txBuffer,
+        (void**)&this->inflight,
+        (void**)&this->inflightBuffer,
+        (void**)&this->outBuffer,
+        (void**)&this->offlineQueue,
+        (void**)&this->incomingQos2,
+        (void**)&this->subscriptions
+    };
+    size_t sizes[] = {
+        (this->bufferFixed || this->bufferSize == 0) ? 0U : this->bufferSize,
+        this->txSeparate ? this->txBufferSize : 0U,
+        (this->inflight == NULL) ? 0U : this->maxInflight*sizeof(MQTTInflightMessage),
+        (this->inflightBuffer == NULL) ? 0U : this->inflightBufferSize,
+        (this->outBuffer == NULL) ? 0U : (size_t)this->outSize,
+        (this->offlineQueue == NULL) ? 0U : this->offlineSize,
+        (this->incomingQos2 == NULL) ? 0U : MQTT_MAX_INCOMING_QOS2*sizeof(uint16_t),
+        (this->subscriptions == NULL) ? 0U : MQTT_MAX_SUBSCRIBE_STATUS*sizeof(MQTTSubscribeStatus)
+    };
+    const uint8_t count = sizeof(sizes)/sizeof(sizes[0]);
+    void* moved[count];
+    boolean rc = true;
+    for (uint8_t i = 0; i < count; i++) {
+        moved[i] = (rc && sizes[i] > 0) ? allocator.allocate(sizes[i]) : NULL;
+        if (sizes[i] > 0 && moved[i] == NULL) {
+            rc = false;
+        }
+    }
+#if MQTT_VERSION == MQTT_VERSION_5
+    // Each topic alias holds its encoded topic
+    uint8_t* aliases[MQTT_MAX_TOPIC_ALIASES];
+    uint16_t aliasCount = 0;
+    while (rc && aliasCount < this->topicAliasCount) {
+        const uint8_t* alias = this->topicAliases[aliasCount];
+        uint16_t size = 2+(alias[0]<<8)+alias[1];
+        aliases[aliasCount] = (uint8_t*)allocator.allocate(size);
+        if (aliases[aliasCount] == NULL) {
+            rc = false;
+        } else {
+            memcpy(aliases[aliasCount++],alias,size);
+        }
+    }
+#endif
+    MQTTTopicNode* trie = NULL;
+    if (rc) {
+        rc = copyTopicNodes(&allocator,this->topicTrie,&trie);
+    }
+    if (!rc) {
+        for (uint8_t i = 0; i < count; i++) {
+            if (moved[i] != NULL) {
+                allocator.release(moved[i]);
+            }
+        }
+#if MQTT_VERSION == MQTT_VERSION_5
+        while (aliasCount-- > 0) {
+            allocator.release(aliases[aliasCount]);
+        }
+#endif
+        return false;
+    }
+#if MQTT_VERSION == MQTT_VERSION_5
+    for (uint16_t i = 0; i < this->topicAliasCount; i++) {
+        release(this->topicAliases[i]);
+        this->topicAliases[i] = aliases[i];
+    }
+#endif
+    freeTopicNodes(this->allocator,this->topicTrie);
+    this->topicTrie = trie;
+    for (uint8_t i = 0; i < count; i++) {
+        if (moved[i] != NULL) {
+            memcpy(moved[i],*blocks[i],sizes[i]);
+            release(*blocks[i]);
+            *blocks[i] = moved[i];
+        }
+    }
+    if (!this->txSeparate) {
+        this->txBuffer = this->buffer;
+    }
+    this->allocator = &allocator;
+    return true;
+}
+
+void* PubSubClient::allocate(size_t size) {
+    return allocateFrom(this->allocator,size);
+}
+
+void PubSubClient::release(void* ptr) {
+    releaseTo(this->allocator,ptr);
 }
 
 uint16_t PubSubClient::getBufferSize() {
     return this->bufferSize;
 }
+
+uint16_t PubSubClient::getTxBufferSize() {
+    return this->txBufferSize;
+}
+
+boolean PubSubClient::setInflight(uint8_t count, uint16_t size) {
+    if (count == 0 || size == 0 || this->inflightCount > 0) {
+        return false;
+    }
+    // Nothing is in flight, so there is nothing to copy
+    MQTTInflightMessage* newInflight = (MQTTInflightMessage*)allocate(count*sizeof(MQTTInflightMessage));
+    uint8_t* newBuffer = (uint8_t*)allocate(size);
+    if (newInflight == NULL || newBuffer == NULL) {
+        release(newInflight);
+        release(newBuffer);
+        return false;
+    }
+    release(this->inflight);
+    release(this->inflightBuffer);
+    this->inflight = newInflight;
+    this->inflightBuffer = newBuffer;
+    this->maxInflight = count;
+    this->inflightBufferSize = size;
+    this->inflightUsed = 0;
+    return true;
+}
+
+PubSubClient& PubSubClient::setStore(MQTTStore& store) {
+    this->store = &store;
+    return *this;
+}
+
+uint8_t PubSubClient::getInflightCount() {
+    return this->inflightCount;
+}
+
+uint16_t PubSubClient::getLastMsgId() {
+    return this->lastMsgId;
+}
 PubSubClient& PubSubClient::setKeepAlive(uint16_t keepAlive) {
     this->keepAlive = keepAlive;
     return *this;
@@ -767,3 +2672,156 @@ PubSubClient& PubSubClient::setSocketTimeout(uint16_t timeout) {
     this->socketTimeout = timeout;
     return *this;
 }
+PubSubClient& PubSubClient::setRetryTimeout(uint16_t timeout) {
+    this->retryTimeout = timeout;
+    return *this;
+}
+
+PubSubClient& PubSubClient::setReconnect(uint32_t minDelay, uint32_t maxDelay, uint16_t attempts) {
+    this->reconnectMinDelay = minDelay;
+    this->reconnectMaxDelay = (maxDelay < minDelay)?minDelay:maxDelay;
+    this->reconnectLimit = attempts;
+    this->reconnectPending = false;
+    return *this;
+}
+
+uint32_t PubSubClient::nextAttemptIn() {
+    scheduleReconnect();
+    if (!this->reconnectPending) {
+        return MQTT_RECONNECT_NEVER;
+    }
+    return remaining(millis(),this->reconnectFrom,this->reconnectDelay);
+}
+
+uint32_t PubSubClient::millisUntilNextAction() {
+    if ((this->_state == MQTT_CONNECTING || connected()) && (_client->available() || wantsWrite())) {
+        return 0;
+    }
+    return millisUntilTimer();
+}
+
+uint32_t PubSubClient::millisUntilTimer() {
+    unsigned long t = millis();
+    if (this->_state == MQTT_CONNECTING) {
+        // Waiting for the CONNACK
+        return remaining(t,lastInActivity,this->socketTimeout*1000UL);
+    }
+    if (!connected()) {
+        return nextAttemptIn();
+    }
+    // loop() pings, or gives up waiting for the PINGRESP, once more than keepAlive
+    // seconds have passed since the older of the last packet in and out
+    unsigned long last = (t-lastInActivity > t-lastOutActivity)?lastInActivity:lastOutActivity;
+    uint32_t next = remaining(t,last,this->connectionKeepAlive*1000UL+1);
+#if MQTT_VERSION != MQTT_VERSION_5
+    for (uint8_t i = 0; i < this->inflightCount; i++) {
+        uint32_t resend = remaining(t,this->inflight[i].sent,this->retryTimeout*1000UL);
+        if (resend < next) {
+            next = resend;
+        }
+    }
+#endif
+    return next;
+}
+
+// Picks when to next try to reconnect, once the connection has gone. The wait is
+// anywhere up to the backoff limit ("full jitter")
+void PubSubClient::scheduleReconnect() {
+    if (this->reconnectPending || this->reconnectMinDelay == 0 || !this->reconnectWanted) {
+        return;
+    }
+    if (this->_state == MQTT_CONNECTING || connected()) {
+        return;
+    }
+    if (this->reconnectLimit > 0 && this->reconnectFailures >= this->reconnectLimit) {
+        // Given up
+        return;
+    }
+    uint32_t limit = this->reconnectMinDelay;
+    for (uint16_t i = 0; i < this->reconnectFailures && limit < this->reconnectMaxDelay; i++) {
+        limit = (limit > this->reconnectMaxDelay/2)?this->reconnectMaxDelay:limit*2;
+    }
+    if (this->reconnectRandom == 0) {
+        // Seeded from the client id as well as the time, so clients started
+        // together still pick different delays
+        uint32_t seed = 2166136261UL;
+        for (const char* c = this->connectId; c != NULL && *c; c++) {
+            seed = (seed ^ (uint8_t)*c)*16777619UL;
+        }
+        seed ^= millis();
+        this->reconnectRandom = (seed != 0)?seed:1;
+    }
+    // xorshift32
+    uint32_t r = this->reconnectRandom;
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    this->reconnectRandom = r;
+    this->reconnectDelay = (limit == 0xFFFFFFFF)?r:r%(limit+1);
+    this->reconnectFrom = millis();
+    this->reconnectPending = true;
+}
+
+TopicHandle::TopicHandle() {
+    this->encoded = NULL;
+    this->size = 0;
+    this->allocator = NULL;
+}
+
+TopicHandle::TopicHandle(const char* topic, MQTTAllocator* allocator) {
+    this->encoded = NULL;
+    this->size = 0;
+    this->allocator = allocator;
+    if (topic) {
+        size_t tlen = strlen(topic);
+        if (tlen <= 0xFFFF-2) {
+            this->encoded = (uint8_t*)allocateFrom(allocator,2+tlen);
+        }
+        if (this->encoded) {
+            this->encoded[0] = (tlen >> 8);
+            this->encoded[1] = (tlen & 0xFF);
+            memcpy(this->encoded+2,topic,tlen);
+            this->size = 2+tlen;
+        }
+    }
+}
+
+TopicHandle::TopicHandle(const TopicHandle& other) {
+    this->encoded = NULL;
+    this->size = 0;
+    this->allocator = NULL;
+    *this = other;
+}
+
+TopicHandle& TopicHandle::operator=(const TopicHandle& other) {
+    if (this != &other) {
+        releaseTo(this->allocator,this->encoded);
+        this->encoded = NULL;
+        this->size = 0;
+        this->allocator = other.allocator;
+        if (other.encoded) {
+            this->encoded = (uint8_t*)allocateFrom(this->allocator,other.size);
+            if (this->encoded) {
+                memcpy(this->encoded,other.encoded,other.size);
+                this->size = other.size;
+            }
+        }
+    }
+    return *this;
+}
+
+TopicHandle::~TopicHandle() {
+    releaseTo(this->allocator,this->encoded);
+}
+
+boolean TopicHandle::valid() const {
+    return this->encoded != NULL;
+}
+
+const uint8_t* TopicHandle::bytes() const {
+    return this->encoded;
+}
+
+uint16_t TopicHandle::length() const {
+    return this->size;
+}
@@ -10,13 +10,18 @@
 #include <Arduino.h>
 #include "IPAddress.h"
 #include "Client.h"
+#include "ExtendedClient.h"
+#include "MQTTStore.h"
+#include "MQTTAllocator.h"
 #include "Stream.h"
 
 #define MQTT_VERSION_3_1      3
 #define MQTT_VERSION_3_1_1    4
+#define MQTT_VERSION_5        5
 
 // MQTT_VERSION : Pick the version
 //#define MQTT_VERSION MQTT_VERSION_3_1
+//#define MQTT_VERSION MQTT_VERSION_5
 #ifndef MQTT_VERSION
 #define MQTT_VERSION MQTT_VERSION_3_1_1
 #endif
@@ -36,12 +41,68 @@
 #define MQTT_SOCKET_TIMEOUT 15
 #endif
 
+// MQTT_MAX_INFLIGHT : number of QoS 1 and QoS 2 messages that can be waiting to
+//  be acknowledged at once. Override with setInflight()
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 4
+#endif
+
+// MQTT_INFLIGHT_BUFFER_SIZE : space used to hold QoS 1 and QoS 2 messages until they are
+//  acknowledged, so they can be resent. Override with setInflight()
+#ifndef MQTT_INFLIGHT_BUFFER_SIZE
+#define MQTT_INFLIGHT_BUFFER_SIZE 512
+#endif
+
+// MQTT_MAX_INCOMING_QOS2 : number of QoS 2 messages from the server that can be
+//  waiting for their PUBREL at once. Only the message ids are kept. Brokers send
+//  up to 20 by default (mosquitto's max_inflight_messages); the connection is
+//  dropped, so the server sends them again, if it sends more than this. The
+//  2 bytes per id are only allocated once the first QoS 2 message arrives
+#ifndef MQTT_MAX_INCOMING_QOS2
+#define MQTT_MAX_INCOMING_QOS2 20
+#endif
+
+// MQTT_MAX_SUBSCRIBE_STATUS : number of recent SUBSCRIBE and UNSUBSCRIBE packets
+//  whose result can be read with subscribeStatus(). The table is only allocated
+//  once the first one is sent
+#ifndef MQTT_MAX_SUBSCRIBE_STATUS
+#define MQTT_MAX_SUBSCRIBE_STATUS 8
+#endif
+
+// MQTT_RETRY_TIMEOUT : time in Seconds to wait for a PUBACK, PUBREC or PUBCOMP
+//  before resending a PUBLISH or PUBREL. Override with setRetryTimeout()
+#ifndef MQTT_RETRY_TIMEOUT
+#define MQTT_RETRY_TIMEOUT 20
+#endif
+
 // MQTT_MAX_TRANSFER_SIZE : limit how much data is passed to the network client
 //  in each write call. Needed for the Arduino Wifi Shield. Leave undefined to
 //  pass the entire MQTT packet in each write call.
 //#define MQTT_MAX_TRANSFER_SIZE 80
 
+// MQTT_OUTBOUND_BUFFER_SIZE : space used to hold outgoing bytes the network client
+//  has not taken yet, and to collect outgoing packets between cork() and uncork().
+//  Only allocated when first needed. It grows for as long as it takes to send the
+//  rest of a packet the client has taken part of
+#ifndef MQTT_OUTBOUND_BUFFER_SIZE
+#define MQTT_OUTBOUND_BUFFER_SIZE 512
+#endif
+
+// MQTT_MAX_TOPIC_ALIASES : with MQTT 5, the number of topics that QoS 0 messages
+//  are published to with a 2 byte topic alias in place of the topic, once the
+//  first message to each has been sent. The server can allow fewer
+#ifndef MQTT_MAX_TOPIC_ALIASES
+#define MQTT_MAX_TOPIC_ALIASES 10
+#endif
+
+// MQTT_READ_CHUNK_SIZE : size of the stack buffer used to read the part of an
+//  inbound packet that does not fit in the buffer (only passed to the Stream).
+#ifndef MQTT_READ_CHUNK_SIZE
+#define MQTT_READ_CHUNK_SIZE 32
+#endif
+
 // Possible values for client.state()
+#define MQTT_CONNECTING             -5
 #define MQTT_CONNECTION_TIMEOUT     -4
 #define MQTT_CONNECTION_LOST        -3
 #define MQTT_CONNECT_FAILED         -2
@@ -52,6 +113,20 @@
 #define MQTT_CONNECT_UNAVAILABLE     3
 #define MQTT_CONNECT_BAD_CREDENTIALS 4
 #define MQTT_CONNECT_UNAUTHORIZED    5
+// With MQTT 5, a connect the server refuses, or a DISCONNECT from the server,
+// leaves its reason code (0x80 or above) in state()
+
+// Returned by nextAttemptIn() when no reconnect is going to be attempted
+#define MQTT_RECONNECT_NEVER      0xFFFFFFFF
+
+// What setOfflineQueue() does with a message that does not fit
+#define MQTT_QUEUE_DROP_NEWEST    0 // Refuse the new message
+#define MQTT_QUEUE_DROP_OLDEST    1 // Drop the oldest messages to make room
+
+// Results from subscribeStatus(). Otherwise it returns the granted QoS
+#define MQTT_SUBSCRIBE_FAILED     0x80 // The server refused at least one topic filter
+#define MQTT_SUBSCRIBE_PENDING    0xFE // Waiting for the SUBACK or UNSUBACK
+#define MQTT_SUBSCRIBE_UNKNOWN    0xFF // Not one of the recent packets
 
 #define MQTTCONNECT     1 << 4  // Client request to connect to Server
 #define MQTTCONNACK     2 << 4  // Connect Acknowledgment
@@ -72,61 +147,390 @@
 #define MQTTQOS0        (0 << 1)
 #define MQTTQOS1        (1 << 1)
 #define MQTTQOS2        (2 << 1)
+#define MQTTDUP         (1 << 3)
+
+// MQTT 5 property identifiers used by the client
+#define MQTT_PROP_SERVER_KEEP_ALIVE    0x13
+#define MQTT_PROP_RECEIVE_MAXIMUM      0x21
+#define MQTT_PROP_TOPIC_ALIAS_MAXIMUM  0x22
+#define MQTT_PROP_TOPIC_ALIAS          0x23
+#define MQTT_PROP_MAXIMUM_QOS          0x24
+#define MQTT_PROP_RETAIN_AVAILABLE     0x25
+#define MQTT_PROP_MAXIMUM_PACKET_SIZE  0x27
 
 // Maximum size of fixed header and variable length size header
 #define MQTT_MAX_HEADER_SIZE 5
 
+// Room needed for properties. With MQTT 5 an empty set of properties is just
+// their length, and a QoS 0 PUBLISH may also carry a topic alias
+#if MQTT_VERSION == MQTT_VERSION_5
+#define MQTT_EMPTY_PROPERTIES_SIZE   1
+#define MQTT_PUBLISH_PROPERTIES_SIZE 4
+#else
+#define MQTT_EMPTY_PROPERTIES_SIZE   0
+#define MQTT_PUBLISH_PROPERTIES_SIZE 0
+#endif
+
+// Largest value that fits in the 4 byte variable length size header
+#define MQTT_MAX_REMAINING_LENGTH 268435455UL
+
+// Inbound packet parser states
+#define MQTT_RX_HEADER          0 // Waiting for the fixed header byte
+#define MQTT_RX_LENGTH          1 // Reading the remaining length
+#define MQTT_RX_VARIABLE_HEADER 2 // Reading the topic length of a PUBLISH
+#define MQTT_RX_BODY            3 // Reading the rest of the packet
+#define MQTT_RX_PROPERTIES      4 // MQTT 5: reading the length of the properties of a PUBLISH
+
+// Progress of a PUBLISH being passed to the chunk callbacks
+#define MQTT_CHUNK_NONE     0 // Not chunked - the whole packet is in the buffer
+#define MQTT_CHUNK_WAITING  1 // Reading the topic, before calling messageBegin
+#define MQTT_CHUNK_STARTED  2 // Passing the payload to messageChunk
+#define MQTT_CHUNK_DUPLICATE 3 // A QoS 2 message already received - the payload is discarded
+
+// A QoS 1 or QoS 2 PUBLISH that has been sent and is waiting to be acknowledged.
+// The packet itself is held in the inflight buffer, in the same order as the table,
+// until the PUBACK or PUBREC arrives. A QoS 2 message then only needs its id kept
+// until the PUBCOMP.
+typedef struct {
+   uint16_t msgId;
+   uint16_t length;
+   uint8_t state; // The packet type being waited for - MQTTPUBACK, MQTTPUBREC or MQTTPUBCOMP
+   unsigned long sent;
+} MQTTInflightMessage;
+
+// A SUBSCRIBE or UNSUBSCRIBE that has been sent, and its result once acknowledged
+typedef struct {
+   uint16_t msgId;
+   uint8_t status;
+} MQTTSubscribeStatus;
+
 #if defined(ESP8266) || defined(ESP32)
 #include <functional>
 #define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+#define MQTT_HANDLER_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> handler
 #else
 #define MQTT_CALLBACK_SIGNATURE void (*callback)(char*, uint8_t*, unsigned int)
+#define MQTT_HANDLER_SIGNATURE void (*handler)(char*, uint8_t*, unsigned int)
+#endif
+
+#if defined(ESP8266) || defined(ESP32)
+#define MQTT_RAW_CALLBACK_SIGNATURE std::function<void(const char*, uint16_t, uint8_t*, unsigned int)> rawCallback
+#define MQTT_MESSAGE_BEGIN_SIGNATURE std::function<void(const char*, uint16_t, uint32_t)> messageBegin
+#define MQTT_MESSAGE_CHUNK_SIGNATURE std::function<void(uint8_t*, unsigned int)> messageChunk
+#define MQTT_MESSAGE_END_SIGNATURE std::function<void()> messageEnd
+#define MQTT_CONNECT_CALLBACK_SIGNATURE std::function<void(int)> connectCallback
+#define MQTT_PUBLISH_CALLBACK_SIGNATURE std::function<void(uint16_t, uint8_t)> publishCallback
+#define MQTT_SUBSCRIBE_CALLBACK_SIGNATURE std::function<void(uint16_t, const uint8_t*, uint16_t)> subscribeCallback
+#define MQTT_UNSUBSCRIBE_CALLBACK_SIGNATURE std::function<void(uint16_t)> unsubscribeCallback
+#else
+#define MQTT_RAW_CALLBACK_SIGNATURE void (*rawCallback)(const char*, uint16_t, uint8_t*, unsigned int)
+#define MQTT_MESSAGE_BEGIN_SIGNATURE void (*messageBegin)(const char*, uint16_t, uint32_t)
+#define MQTT_MESSAGE_CHUNK_SIGNATURE void (*messageChunk)(uint8_t*, unsigned int)
+#define MQTT_MESSAGE_END_SIGNATURE void (*messageEnd)()
+#define MQTT_CONNECT_CALLBACK_SIGNATURE void (*connectCallback)(int)
+#define MQTT_PUBLISH_CALLBACK_SIGNATURE void (*publishCallback)(uint16_t, uint8_t)
+#define MQTT_SUBSCRIBE_CALLBACK_SIGNATURE void (*subscribeCallback)(uint16_t, const uint8_t*, uint16_t)
+#define MQTT_UNSUBSCRIBE_CALLBACK_SIGNATURE void (*unsubscribeCallback)(uint16_t)
 #endif
 
-#define CHECK_STRING_LENGTH(l,s) if (l+2+strnlen(s, this->bufferSize) > this->bufferSize) {_client->stop();return false;}
+// One level of a topic filter in the handler trie. Siblings at the same level
+// are chained through next; the levels below are reached through child.
+struct MQTTTopicNode {
+   MQTTTopicNode* child;
+   MQTTTopicNode* next;
+   MQTT_HANDLER_SIGNATURE; // Called for messages matching the filter that ends here
+   uint16_t length;
+   char* level;
+};
+
+// A topic encoded once, with its length prefix, so it can be published to any
+// number of times without being measured and copied again. Create one with
+// PubSubClient::topic()
+class TopicHandle {
+private:
+   uint8_t* encoded;
+   uint16_t size;
+   // Where encoded came from, if not the heap
+   MQTTAllocator* allocator;
+public:
+   TopicHandle();
+   // The encoded topic is allocated with allocator, if one is given, rather than malloc()
+   explicit TopicHandle(const char* topic, MQTTAllocator* allocator = NULL);
+   TopicHandle(const TopicHandle& other);
+   TopicHandle& operator=(const TopicHandle& other);
+   ~TopicHandle();
+   // False if there was not enough memory to encode the topic
+   boolean valid() const;
+   // The encoded topic - length prefix followed by the topic
+   const uint8_t* bytes() const;
+   // The length of the encoded topic, including the length prefix
+   uint16_t length() const;
+};
+
+// The constructors that take a network client are templates, so one that is an
+// ExtendedClient reaches setClient(ExtendedClient&). This keeps them to types
+// derived from Client, so the callback is never mistaken for the client
+template <typename T> struct MQTTIsClient {
+   static char check(Client*);
+   static long check(...);
+   enum { value = (sizeof(check((T*)NULL)) == sizeof(char)) };
+};
+template <bool IsClient> struct MQTTClientOnly {};
+template <> struct MQTTClientOnly<true> { typedef int type; };
+#define MQTT_CLIENT_TEMPLATE template <typename ClientType, typename MQTTClientOnly<MQTTIsClient<ClientType>::value>::type = 0>
+
+#define CHECK_STRING_LENGTH(l,s) if (l+2+strnlen(s, this->txBufferSize) > this->txBufferSize) {_client->stop();return false;}
 
 class PubSubClient : public Print {
 private:
    Client* _client;
+   ExtendedClient* _extClient;
    uint8_t* buffer;
    uint16_t bufferSize;
+   // The buffer is not the client's to free or resize, and can be used up to
+   // bufferCapacity bytes
+   boolean bufferFixed;
+   uint16_t bufferCapacity;
+   // Outgoing packets are built here. Unless it has been given its own size,
+   // this is the same memory as the buffer incoming packets are read into
+   uint8_t* txBuffer;
+   uint16_t txBufferSize;
+   boolean txSeparate;
+   // Where the buffers come from, if not the heap
+   MQTTAllocator* allocator;
+   void* allocate(size_t size);
+   void release(void* ptr);
    uint16_t keepAlive;
+   // The keep alive in force on this connection: keepAlive, or with MQTT 5 the
+   // Server Keep Alive if the server set one
+   uint16_t connectionKeepAlive;
    uint16_t socketTimeout;
+   uint16_t retryTimeout;
    uint16_t nextMsgId;
+   uint16_t lastMsgId;
+   // QoS 1 messages waiting for their PUBACK
+   MQTTInflightMessage* inflight;
+   uint8_t maxInflight;
+   uint8_t inflightCount;
+   uint8_t* inflightBuffer;
+   uint16_t inflightBufferSize;
+   uint16_t inflightUsed;
+   // Where the inflight messages are kept safe, if anywhere
+   MQTTStore* store;
+   // Ids of QoS 2 messages from the server that have been delivered and are
+   // waiting for their PUBREL, so a resent message is not delivered twice.
+   // Only allocated when the first QoS 2 message arrives
+   uint16_t* incomingQos2;
+   uint8_t incomingQos2Count;
+   // Ring buffer of outgoing bytes waiting to be sent, either because the client
+   // did not take them all or because the client is corked
+   uint8_t* outBuffer;
+   uint32_t outSize;
+   uint32_t outHead;
+   uint32_t outUsed;
+   boolean corked;
+   // Set when sendPacket() turns a packet away without sending any of it, so it
+   // can be tried again later
+   boolean sendRefused;
+   // Messages published while disconnected. Each is kept in one piece: a 2 byte
+   // length, the QoS and retain flags, the encoded topic and the payload
+   uint8_t* offlineQueue;
+   uint16_t offlineSize;
+   uint16_t offlineStart;
+   uint16_t offlineEnd;
+   uint16_t offlineCount;
+   uint16_t offlineDropped;
+   uint8_t offlinePolicy;
+   // Handlers registered with subscribe(), by topic filter
+   MQTTTopicNode* topicTrie;
+   // The most recent SUBSCRIBE and UNSUBSCRIBE packets, oldest overwritten first.
+   // Only allocated when the first one is sent
+   MQTTSubscribeStatus* subscriptions;
+   uint8_t subscriptionCount;
+   uint8_t subscriptionNext;
    unsigned long lastOutActivity;
    unsigned long lastInActivity;
    bool pingOutstanding;
    MQTT_CALLBACK_SIGNATURE;
+   MQTT_RAW_CALLBACK_SIGNATURE;
+   MQTT_MESSAGE_BEGIN_SIGNATURE;
+   MQTT_MESSAGE_CHUNK_SIGNATURE;
+   MQTT_MESSAGE_END_SIGNATURE;
+   MQTT_CONNECT_CALLBACK_SIGNATURE;
+   MQTT_PUBLISH_CALLBACK_SIGNATURE;
+   MQTT_SUBSCRIBE_CALLBACK_SIGNATURE;
+   MQTT_UNSUBSCRIBE_CALLBACK_SIGNATURE;
+   // Reconnecting from loop(), with the parameters of the last connect
+   uint32_t reconnectMinDelay;
+   uint32_t reconnectMaxDelay;
+   uint16_t reconnectLimit;
+   uint16_t reconnectFailures;
+   // Only reconnect after losing a connection that was asked for
+   boolean reconnectWanted;
+   boolean reconnectPending;
+   unsigned long reconnectFrom;
+   uint32_t reconnectDelay;
+   uint32_t reconnectRandom;
+   const char* connectId;
+   const char* connectUser;
+   const char* connectPass;
+   const char* connectWillTopic;
+   uint8_t connectWillQos;
+   boolean connectWillRetain;
+   const char* connectWillMessage;
+   boolean connectCleanSession;
+   void scheduleReconnect();
+   void reconnectIfDue();
+   boolean checkKeepAlive();
+   boolean handleInbound();
+   // Inbound packet parser state, kept between calls to readPacket
+   uint8_t rxState;
+   uint8_t rxLengthLength;
+   uint8_t rxChunk;
+   // The QoS 2 message being passed to the chunk callbacks has taken the last
+   // place in incomingQos2
+   boolean rxQos2Reserved;
+   uint16_t rxLen;
+   uint32_t rxRemaining;
+   uint32_t rxMultiplier;
+   uint32_t rxIndex;
+   uint32_t rxEnd;
+   uint32_t rxPayloadStart;
+#if MQTT_VERSION == MQTT_VERSION_5
+   // The properties of the PUBLISH being read come before rxPayloadStart, which
+   // moves past them once their length is known
+   boolean rxProperties;
+   // Limits the server set in its CONNACK
+   uint16_t serverReceiveMaximum;
+   uint32_t serverMaximumPacketSize;
+   uint8_t serverMaximumQos;
+   boolean serverRetainAvailable;
+   // Encoded topics given an alias on this connection. Alias n is topicAliases[n-1]
+   uint8_t* topicAliases[MQTT_MAX_TOPIC_ALIASES];
+   uint16_t topicAliasCount;
+   uint16_t topicAliasMaximum;
+   uint8_t readVarint(const uint8_t* buf, uint32_t length, uint32_t* value);
+   uint32_t propertyLength(const uint8_t* buf, uint32_t length);
+   uint32_t skipProperties(const uint8_t* buf, uint32_t length);
+   void readConnackProperties(const uint8_t* buf, uint32_t length);
+   boolean withinMaximumPacketSize(uint32_t length);
+   uint16_t findTopicAlias(const uint8_t* topic, uint16_t tlen);
+   void clearTopicAliases();
+#endif
    uint32_t readPacket(uint8_t*);
-   boolean readByte(uint8_t * result);
-   boolean readByte(uint8_t * result, uint16_t * index);
+   void checkConnack();
+   uint16_t nextPacketId();
+   void resendInflight(boolean all);
+   void ackInflight(uint8_t type, uint16_t msgId, uint8_t reason);
+   void restoreInflight();
+   boolean sendAck(uint8_t header, uint16_t msgId);
+   int findIncomingQos2(uint16_t msgId);
+   boolean addIncomingQos2(uint16_t msgId);
+   void trackSubscription(uint16_t msgId);
+   boolean addHandler(const char* filter, MQTT_HANDLER_SIGNATURE);
+   boolean hasHandler(const char* filter);
+   boolean removeHandler(MQTTTopicNode** link, const char* filter);
+   boolean dispatch(MQTTTopicNode* node, char* topic, const char* level, uint8_t* payload, unsigned int plength);
+   MQTTSubscribeStatus* findSubscription(uint16_t msgId);
    boolean write(uint8_t header, uint8_t* buf, uint16_t length);
+   boolean write(uint8_t header, uint8_t* buf, uint16_t length, const uint8_t* payload, uint32_t plength);
+   boolean sendBytes(const uint8_t* buf, uint32_t length);
+   boolean sendControl(const uint8_t* buf, uint32_t length);
+   boolean sendPacket(const uint8_t* buf, uint32_t length, const uint8_t* payload, uint32_t plength);
+   boolean sendPacket(const uint8_t* const* buffers, const uint32_t* lengths, uint8_t count);
+   boolean writePublish(uint8_t header, const uint8_t* topic, uint16_t tlen, const uint8_t* properties, uint8_t propertiesLength, const uint8_t* payload, uint32_t plength);
+   uint32_t writeBytes(const uint8_t* buf, uint32_t length);
+   boolean queueOutbound(const uint8_t* buf, uint32_t length);
+   boolean flushOutbound();
+   void abortConnection();
+   boolean growOutbound(uint32_t length);
+   boolean publishEncoded(const uint8_t* topic, uint16_t tlen, const uint8_t* payload, uint32_t plength, boolean retained, uint8_t qos);
+   boolean queueOffline(const uint8_t* topic, uint16_t tlen, const uint8_t* payload, uint32_t plength, boolean retained, uint8_t qos);
+   uint8_t* peekOffline();
+   void dropOffline();
+   void flushOffline();
+   boolean beginPublishEncoded(uint16_t tlen, uint32_t plength, boolean retained);
+   boolean writeSubscriptions(uint8_t header, const char* const* topics, const uint8_t* qos, size_t count);
    uint16_t writeString(const char* string, uint8_t* buf, uint16_t pos);
    // Build up the header ready to send
    // Returns the size of the header
    // Note: the header is built at the end of the first MQTT_MAX_HEADER_SIZE bytes, so will start
    //       (MQTT_MAX_HEADER_SIZE - <returned size>) bytes into the buffer
-   size_t buildHeader(uint8_t header, uint8_t* buf, uint16_t length);
+   size_t buildHeader(uint8_t header, uint8_t* buf, uint32_t length);
    IPAddress ip;
    const char* domain;
    uint16_t port;
    Stream* stream;
    int _state;
+   void init();
+protected:
+   // Use buffer, which stays owned by the caller, rather than allocating one
+   PubSubClient(uint8_t* buffer, uint16_t size);
 public:
    PubSubClient();
-   PubSubClient(Client& client);
-   PubSubClient(IPAddress, uint16_t, Client& client);
-   PubSubClient(IPAddress, uint16_t, Client& client, Stream&);
-   PubSubClient(IPAddress, uint16_t, MQTT_CALLBACK_SIGNATURE,Client& client);
-   PubSubClient(IPAddress, uint16_t, MQTT_CALLBACK_SIGNATURE,Client& client, Stream&);
-   PubSubClient(uint8_t *, uint16_t, Client& client);
-   PubSubClient(uint8_t *, uint16_t, Client& client, Stream&);
-   PubSubClient(uint8_t *, uint16_t, MQTT_CALLBACK_SIGNATURE,Client& client);
-   PubSubClient(uint8_t *, uint16_t, MQTT_CALLBACK_SIGNATURE,Client& client, Stream&);
-   PubSubClient(const char*, uint16_t, Client& client);
-   PubSubClient(const char*, uint16_t, Client& client, Stream&);
-   PubSubClient(const char*, uint16_t, MQTT_CALLBACK_SIGNATURE,Client& client);
-   PubSubClient(const char*, uint16_t, MQTT_CALLBACK_SIGNATURE,Client& client, Stream&);
+   MQTT_CLIENT_TEMPLATE PubSubClient(ClientType& client) : PubSubClient() {
+      setClient(client);
+   }
+   MQTT_CLIENT_TEMPLATE PubSubClient(IPAddress addr, uint16_t port, ClientType& client) : PubSubClient() {
+      setServer(addr,port);
+      setClient(client);
+   }
+   MQTT_CLIENT_TEMPLATE PubSubClient(IPAddress addr, uint16_t port, ClientType& client, Stream& stream) : PubSubClient() {
+      setServer(addr,port);
+      setClient(client);
+      setStream(stream);
+   }
+   MQTT_CLIENT_TEMPLATE PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATURE, ClientType& client) : PubSubClient() {
+      setServer(addr,port);
+      setCallback(callback);
+      setClient(client);
+   }
+   MQTT_CLIENT_TEMPLATE PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATURE, ClientType& client, Stream& stream) : PubSubClient() {
+      setServer(addr,port);
+      setCallback(callback);
+      setClient(client);
+      setStream(stream);
+   }
+   MQTT_CLIENT_TEMPLATE PubSubClient(uint8_t *ip, uint16_t port, ClientType& client) : PubSubClient() {
+      setServer(ip,port);
+      setClient(client);
+   }
+   MQTT_CLIENT_TEMPLATE PubSubClient(uint8_t *ip, uint16_t port, ClientType& client, Stream& stream) : PubSubClient() {
+      setServer(ip,port);
+      setClient(client);
+      setStream(stream);
+   }
+   MQTT_CLIENT_TEMPLATE PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE, ClientType& client) : PubSubClient() {
+      setServer(ip,port);
+      setCallback(callback);
+      setClient(client);
+   }
+   MQTT_CLIENT_TEMPLATE PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE, ClientType& client, Stream& stream) : PubSubClient() {
+      setServer(ip,port);
+      setCallback(callback);
+      setClient(client);
+      setStream(stream);
+   }
+   MQTT_CLIENT_TEMPLATE PubSubClient(const char* domain, uint16_t port, ClientType& client) : PubSubClient() {
+      setServer(domain,port);
+      setClient(client);
+   }
+   MQTT_CLIENT_TEMPLATE PubSubClient(const char* domain, uint16_t port, ClientType& client, Stream& stream) : PubSubClient() {
+      setServer(domain,port);
+      setClient(client);
+      setStream(stream);
+   }
+   MQTT_CLIENT_TEMPLATE PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE, ClientType& client) : PubSubClient() {
+      setServer(domain,port);
+      setCallback(callback);
+      setClient(client);
+   }
+   MQTT_CLIENT_TEMPLATE PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE, ClientType& client, Stream& stream) : PubSubClient() {
+      setServer(domain,port);
+      setCallback(callback);
+      setClient(client);
+      setStream(stream);
+   }
 
    ~PubSubClient();
 
@@ -134,26 +538,154 @@ public:
    PubSubClient& setServer(uint8_t * ip, uint16_t port);
    PubSubClient& setServer(const char * domain, uint16_t port);
    PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE);
+   // Set a function to receive messages without them being rewritten in the buffer.
+   // It is passed the topic and its length, and the payload and its length, all
+   // pointing into the buffer. The topic is not null terminated.
+   // Can be used instead of, or as well as, the callback set with setCallback()
+   PubSubClient& setRawCallback(MQTT_RAW_CALLBACK_SIGNATURE);
+   // Set functions to receive messages that are too big for the buffer, as the data arrives.
+   // messageBegin is passed the topic (not null terminated), its length and the total
+   // payload length. messageChunk is then called with each piece of the payload as it is
+   // read, and messageEnd once the whole message has been received.
+   // Messages that fit in the buffer are still passed to the other callbacks.
+   PubSubClient& setChunkCallbacks(MQTT_MESSAGE_BEGIN_SIGNATURE, MQTT_MESSAGE_CHUNK_SIGNATURE, MQTT_MESSAGE_END_SIGNATURE);
+   // Set a function to be called with the result of a connect - MQTT_CONNECTED
+   // or the reason it failed (see state())
+   PubSubClient& setConnectCallback(MQTT_CONNECT_CALLBACK_SIGNATURE);
+   // Set a function to be called with the message id of each QoS 1 or QoS 2
+   // message once the server has acknowledged it (PUBACK or PUBCOMP), and the
+   // reason code it gave. With MQTT 5 a reason code of 0x80 or more means the
+   // server refused the message; otherwise it is 0
+   PubSubClient& setPublishCallback(MQTT_PUBLISH_CALLBACK_SIGNATURE);
+   // Set a function to be called when a SUBACK arrives, with the message id of the
+   // SUBSCRIBE and the granted QoS, or MQTT_SUBSCRIBE_FAILED, for each topic filter
+   // in the order they were sent
+   PubSubClient& setSubscribeCallback(MQTT_SUBSCRIBE_CALLBACK_SIGNATURE);
+   // Set a function to be called with the message id of each UNSUBSCRIBE once it
+   // has been acknowledged
+   PubSubClient& setUnsubscribeCallback(MQTT_UNSUBSCRIBE_CALLBACK_SIGNATURE);
    PubSubClient& setClient(Client& client);
+   // Use a client that can send several buffers in one call, so publish()
+   // can send a payload without copying it into the buffer
+   PubSubClient& setClient(ExtendedClient& client);
    PubSubClient& setStream(Stream& stream);
    PubSubClient& setKeepAlive(uint16_t keepAlive);
    PubSubClient& setSocketTimeout(uint16_t timeout);
+   PubSubClient& setRetryTimeout(uint16_t timeout);
+   // Have loop() reconnect when the connection is lost, with the parameters of
+   // the last connect() or connectAsync(), whose strings must stay valid. Each
+   // wait is picked at random from up to a limit that starts at minDelay
+   // milliseconds and doubles after every failed attempt, to no more than maxDelay,
+   // so clients that lose the same server do not all come back at once.
+   // After attempts failures in a row loop() gives up, unless attempts is 0.
+   // A minDelay of 0 turns reconnecting off. disconnect() stops it until the
+   // next connect
+   PubSubClient& setReconnect(uint32_t minDelay, uint32_t maxDelay, uint16_t attempts);
+   // Milliseconds until loop() next tries to reconnect, or MQTT_RECONNECT_NEVER
+   // if it will not
+   uint32_t nextAttemptIn();
+   // Milliseconds until loop() next has something to do: a ping to send, a
+   // CONNACK or PINGRESP that is overdue, a message to resend or a reconnect.
+   // Returns 0 if it has something to do now - including data that has arrived
+   // or is waiting to be sent - and MQTT_RECONNECT_NEVER if it is disconnected
+   // and not going to reconnect. Until then, the sketch only has to call loop()
+   // when the client has data to read
+   uint32_t millisUntilNextAction();
+
+   // For a host with its own event loop, in place of calling loop(). Wait on
+   // getFd() for readability while wantsRead() and for writability while
+   // wantsWrite(), and for millisUntilTimer() at most, then call onReadable(),
+   // onWritable() or onTimer() for whatever happened. Check getFd() again after
+   // each connect, as a client may use a new socket for each connection.
+   // Each returns false if the client is not connected
+   boolean onReadable();
+   boolean onWritable();
+   boolean onTimer();
+   // Whether the client is waiting for data from the server
+   boolean wantsRead();
+   // Whether there are bytes waiting to be written
+   boolean wantsWrite();
+   // The handle of the client passed to setClient(ExtendedClient&), or -1
+   int getFd();
+   // Milliseconds until onTimer() has something to do, as millisUntilNextAction()
+   // but leaving out reading and writing
+   uint32_t millisUntilTimer();
 
+   // Set the size of the buffer incoming packets are read into. Outgoing packets
+   // are built in the same buffer, unless it has been given its own size
    boolean setBufferSize(uint16_t size);
+   // Give outgoing packets a buffer of their own, of txSize bytes, so a message
+   // passed to the callback can be published, or replied to, from where it sits.
+   // A txSize of 0 goes back to sharing one buffer
+   boolean setBufferSize(uint16_t rxSize, uint16_t txSize);
+   // Use size bytes at mem as the buffer, rather than allocating one. The memory
+   // must last as long as the client, which never frees it. setBufferSize() can
+   // then only choose a size up to size
+   boolean setBuffer(uint8_t* mem, uint16_t size);
+   // Allocate buffers with allocator rather than malloc(). Buffers, handlers and
+   // topic aliases already allocated are moved to it, so it is best called straight
+   // after the constructor. TopicHandles keep the memory they were made with
+   boolean setAllocator(MQTTAllocator& allocator);
    uint16_t getBufferSize();
+   uint16_t getTxBufferSize();
+   // Set how many QoS 1 and QoS 2 messages can be waiting to be acknowledged at once, and the space
+   // used to hold them so they can be resent. Cannot be changed while messages are in flight
+   boolean setInflight(uint8_t count, uint16_t size);
+   // Also keep the inflight messages in store, until they are acknowledged. Any
+   // messages already in it are sent again once connected, as room allows
+   PubSubClient& setStore(MQTTStore& store);
+   // Keep messages published while disconnected, in up to size bytes, and send them
+   // in order once reconnected. When there is no room, either the new message is
+   // refused (MQTT_QUEUE_DROP_NEWEST) or the oldest are dropped (MQTT_QUEUE_DROP_OLDEST).
+   // A size of 0 turns the queue off, dropping anything in it
+   boolean setOfflineQueue(uint16_t size, uint8_t policy);
+   // The number of messages waiting to be sent once reconnected
+   uint16_t getOfflineCount();
+   // The number of queued messages dropped without being sent, since setOfflineQueue():
+   // made room for with MQTT_QUEUE_DROP_OLDEST, or refused for good once reconnected
+   uint16_t getOfflineDropped();
+   // The number of QoS 1 and QoS 2 messages not yet acknowledged
+   uint8_t getInflightCount();
+   // The message id used by the most recent QoS 1 or QoS 2 publish, or by the last
+   // packet of the most recent subscribe or unsubscribe
+   uint16_t getLastMsgId();
 
    boolean connect(const char* id);
    boolean connect(const char* id, const char* user, const char* pass);
    boolean connect(const char* id, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
    boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
    boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession);
+   // Start to connect without waiting for the server to respond.
+   // The network connection is opened and the CONNECT packet sent, then loop() completes
+   // the handshake when the CONNACK arrives. Until then state() returns MQTT_CONNECTING.
+   // The connect callback, if set, is called once the connect succeeds or fails.
+   // Returns 1 if the connect was started (or is already in progress), 0 if there was an error
+   boolean connectAsync(const char* id);
+   boolean connectAsync(const char* id, const char* user, const char* pass);
+   boolean connectAsync(const char* id, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
+   boolean connectAsync(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
+   boolean connectAsync(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession);
    void disconnect();
    boolean publish(const char* topic, const char* payload);
    boolean publish(const char* topic, const char* payload, boolean retained);
-   boolean publish(const char* topic, const uint8_t * payload, unsigned int plength);
-   boolean publish(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained);
+   boolean publish(const char* topic, const uint8_t * payload, uint32_t plength);
+   boolean publish(const char* topic, const uint8_t * payload, uint32_t plength, boolean retained);
+   // Publish with the given QoS. A QoS 1 or QoS 2 message is held until the server
+   // acknowledges it, and resent with the DUP flag if the acknowledgement does not
+   // arrive within the retry timeout or the client reconnects. Several messages can
+   // be in flight at once.
+   // Returns 1 if the message was sent, or for QoS 1 and 2, accepted for delivery.
+   // Returns 0 if there is no room left to hold the message
+   boolean publish(const char* topic, const char* payload, boolean retained, uint8_t qos);
+   boolean publish(const char* topic, const uint8_t * payload, uint32_t plength, boolean retained, uint8_t qos);
+   // Encode a topic once, to publish to it many times
+   TopicHandle topic(const char* topic);
+   boolean publish(const TopicHandle& topic, const char* payload);
+   boolean publish(const TopicHandle& topic, const uint8_t * payload, uint32_t plength);
+   boolean publish(const TopicHandle& topic, const uint8_t * payload, uint32_t plength, boolean retained);
+   boolean publish(const TopicHandle& topic, const uint8_t * payload, uint32_t plength, boolean retained, uint8_t qos);
    boolean publish_P(const char* topic, const char* payload, boolean retained);
-   boolean publish_P(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained);
+   boolean publish_P(const char* topic, const uint8_t * payload, uint32_t plength, boolean retained);
    // Start to publish a message.
    // This API:
    //   beginPublish(...)
@@ -161,24 +693,150 @@ public:
    //   endPublish()
    // Allows for arbitrarily large payloads to be sent without them having to be copied into
    // a new buffer and held in memory at one time
+   // The payload can be up to MQTT_MAX_REMAINING_LENGTH bytes, less the topic length and 2
    // Returns 1 if the message was started successfully, 0 if there was an error
-   boolean beginPublish(const char* topic, unsigned int plength, boolean retained);
+   boolean beginPublish(const char* topic, uint32_t plength, boolean retained);
+   boolean beginPublish(const TopicHandle& topic, uint32_t plength, boolean retained);
    // Finish off this publish message (started with beginPublish)
    // Returns 1 if the packet was sent successfully, 0 if there was an error
    int endPublish();
    // Write a single byte of payload (only to be used with beginPublish/endPublish)
    virtual size_t write(uint8_t);
    // Write size bytes from buffer into the payload (only to be used with beginPublish/endPublish)
-   // Returns the number of bytes written
+   // Returns the number of bytes written, which is less than size if the network client
+   // is not keeping up. Pass the rest again once flush() or onWritable() has made room
    virtual size_t write(const uint8_t *buffer, size_t size);
+   // Hold back outgoing packets so a burst of small ones is passed to the network
+   // client in as few writes as possible. They are sent when MQTT_OUTBOUND_BUFFER_SIZE
+   // fills, on each loop() and on flush() or uncork()
+   // Returns 0 if there is not enough memory to hold them
+   boolean cork();
+   // Send anything held back and stop coalescing
+   void uncork();
+   // Send anything held back by cork(), or not yet taken by the client
+   virtual void flush();
    boolean subscribe(const char* topic);
    boolean subscribe(const char* topic, uint8_t qos);
+   // Subscribe and have messages that match the filter passed to handler, rather
+   // than to the callback. The callback only receives messages no handler matches.
+   // Handlers must not subscribe or unsubscribe while they are being called
+   boolean subscribe(const char* topic, uint8_t qos, MQTT_HANDLER_SIGNATURE);
+   // Unsubscribe, removing any handler for the topic filter once the UNSUBSCRIBE
+   // has been sent
    boolean unsubscribe(const char* topic);
+   // Subscribe to count topic filters, each at the matching qos. As many filters
+   // as fit in the buffer are sent in each SUBSCRIBE packet
+   boolean subscribe(const char* const* topics, const uint8_t* qos, size_t count);
+   // Unsubscribe from count topic filters, sent in as few UNSUBSCRIBE packets as fit in the buffer
+   boolean unsubscribe(const char* const* topics, size_t count);
+   // The result of the SUBSCRIBE or UNSUBSCRIBE with the given message id (see
+   // getLastMsgId()). MQTT_SUBSCRIBE_PENDING until it is acknowledged, then the
+   // lowest QoS granted, MQTT_SUBSCRIBE_FAILED if any topic filter was refused, or
+   // 0 for an UNSUBSCRIBE. MQTT_SUBSCRIBE_UNKNOWN if it is not one of the recent
+   // packets, or was sent before the last connect
+   uint8_t subscribeStatus(uint16_t msgId);
    boolean loop();
    boolean connected();
    int state();
 
 };
 
+// A PubSubClient with its buffer inside the object rather than allocated from
+// the heap. The buffer cannot grow, so setBufferSize() accepts no more than
+// BufferSize, and the limits it sets are known at compile time.
+// For example: PubSubClientT<128> client(server, 1883, callback, ethClient);
+template<uint16_t BufferSize = MQTT_MAX_PACKET_SIZE>
+class PubSubClientT : public PubSubClient {
+private:
+   uint8_t storage[BufferSize];
+public:
+   static_assert(BufferSize >= 32, "PubSubClientT needs a buffer of at least 32 bytes");
+   // The longest topic that can be published to, subscribed to or received
+   static constexpr uint16_t maxTopicLength = BufferSize-MQTT_MAX_HEADER_SIZE-2-MQTT_PUBLISH_PROPERTIES_SIZE;
+   // The longest payload that is sure to be received in one piece on a topic
+   // of topicLength
+   static constexpr uint16_t maxPayloadLength(uint16_t topicLength) {
+      return (topicLength+2 > maxTopicLength) ? 0 : maxTopicLength-topicLength-2;
+   }
+
+   PubSubClientT() : PubSubClient(storage,BufferSize) {}
+   MQTT_CLIENT_TEMPLATE
+   PubSubClientT(ClientType& client) : PubSubClient(storage,BufferSize) {
+      setClient(client);
+   }
+   MQTT_CLIENT_TEMPLATE
+   PubSubClientT(IPAddress addr, uint16_t port, ClientType& client) : PubSubClient(storage,BufferSize) {
+      setServer(addr,port);
+      setClient(client);
+   }
+   MQTT_CLIENT_TEMPLATE
+   PubSubClientT(IPAddress addr, uint16_t port, ClientType& client, Stream& stream) : PubSubClient(storage,BufferSize) {
+      setServer(addr,port);
+      setClient(client);
+      setStream(stream);
+   }
+   MQTT_CLIENT_TEMPLATE
+   PubSubClientT(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATURE, ClientType& client) : PubSubClient(storage,BufferSize) {
+      setServer(addr,port);
+      setCallback(callback);
+      setClient(client);
+   }
+   MQTT_CLIENT_TEMPLATE
+   PubSubClientT(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATURE, ClientType& client, Stream& stream) : PubSubClient(storage,BufferSize) {
+      setServer(addr,port);
+      setCallback(callback);
+      setClient(client);
+      setStream(stream);
+   }
+   MQTT_CLIENT_TEMPLATE
+   PubSubClientT(uint8_t* ip, uint16_t port, ClientType& client) : PubSubClient(storage,BufferSize) {
+      setServer(ip,port);
+      setClient(client);
+   }
+   MQTT_CLIENT_TEMPLATE
+   PubSubClientT(uint8_t* ip, uint16_t port, ClientType& client, Stream& stream) : PubSubClient(storage,BufferSize) {
+      setServer(ip,port);
+      setClient(client);
+      setStream(stream);
+   }
+   MQTT_CLIENT_TEMPLATE
+   PubSubClientT(uint8_t* ip, uint16_t port, MQTT_CALLBACK_SIGNATURE, ClientType& client) : PubSubClient(storage,BufferSize) {
+      setServer(ip,port);
+      setCallback(callback);
+      setClient(client);
+   }
+   MQTT_CLIENT_TEMPLATE
+   PubSubClientT(uint8_t* ip, uint16_t port, MQTT_CALLBACK_SIGNATURE, ClientType& client, Stream& stream) : PubSubClient(storage,BufferSize) {
+      setServer(ip,port);
+      setCallback(callback);
+      setClient(client);
+      setStream(stream);
+   }
+   MQTT_CLIENT_TEMPLATE
+   PubSubClientT(const char* domain, uint16_t port, ClientType& client) : PubSubClient(storage,BufferSize) {
+      setServer(domain,port);
+      setClient(client);
+   }
+   MQTT_CLIENT_TEMPLATE
+   PubSubClientT(const char* domain, uint16_t port, ClientType& client, Stream& stream) : PubSubClient(storage,BufferSize) {
+      setServer(domain,port);
+      setClient(client);
+      setStream(stream);
+   }
+   MQTT_CLIENT_TEMPLATE
+   PubSubClientT(const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE, ClientType& client) : PubSubClient(storage,BufferSize) {
+      setServer(domain,port);
+      setCallback(callback);
+      setClient(client);
+   }
+   MQTT_CLIENT_TEMPLATE
+   PubSubClientT(const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE, ClientType& client, Stream& stream) : PubSubClient(storage,BufferSize) {
+      setServer(domain,port);
+      setCallback(callback);
+      setClient(client);
+      setStream(stream);
+   }
+};
+
 
 #endif
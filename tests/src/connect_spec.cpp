@@ -3,6 +3,7 @@
 #include "Buffer.h"
 #include "BDDTest.h"
 #include "trace.h"
+#include <unistd.h>
 
 
 byte server[] = { 172, 16, 0, 2 };
@@ -11,6 +12,18 @@ void callback(char* topic, byte* payload, unsigned int length) {
   // handle message arrived
 }
 
+int connect_callback_state;
+int connect_callback_count;
+
+void connect_callback(int state) {
+    connect_callback_state = state;
+    connect_callback_count++;
+}
+
+void reset_connect_callback() {
+    connect_callback_state = MQTT_DISCONNECTED;
+    connect_callback_count = 0;
+}
 
 int test_connect_fails_no_network() {
     IT("fails to connect if underlying client doesn't connect");
@@ -312,6 +325,177 @@ int test_connect_custom_keepalive() {
 }
 
 
+int test_connect_async() {
+    IT("connects asynchronously");
+    reset_connect_callback();
+    ShimClient shimClient;
+
+    shimClient.setAllowConnect(true);
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x2,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    shimClient.expect(connect,26);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setConnectCallback(connect_callback);
+
+    int rc = client.connectAsync((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_FALSE(shimClient.error());
+    IS_TRUE(client.state() == MQTT_CONNECTING);
+    IS_FALSE(client.connected());
+
+    // No CONNACK yet
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECTING);
+    IS_TRUE(connect_callback_count == 0);
+
+    // A second call does not send another CONNECT
+    rc = client.connectAsync((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_FALSE(shimClient.error());
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.connected());
+    IS_TRUE(client.state() == MQTT_CONNECTED);
+    IS_TRUE(connect_callback_count == 1);
+    IS_TRUE(connect_callback_state == MQTT_CONNECTED);
+
+    END_IT
+}
+
+int test_connect_async_fails_on_bad_rc() {
+    IT("reports a bad return code for an asynchronous connect");
+    reset_connect_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setConnectCallback(connect_callback);
+    int rc = client.connectAsync((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x05 };
+    shimClient.respond(connack,4);
+
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECT_UNAUTHORIZED);
+    IS_TRUE(connect_callback_count == 1);
+    IS_TRUE(connect_callback_state == MQTT_CONNECT_UNAUTHORIZED);
+    IS_FALSE(shimClient.connected());
+
+    END_IT
+}
+
+int test_connect_async_fails_on_no_response() {
+    IT("times out an asynchronous connect (takes 2 seconds)");
+    reset_connect_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setConnectCallback(connect_callback);
+    client.setSocketTimeout(1);
+    int rc = client.connectAsync((char*)"client_test1");
+    IS_TRUE(rc);
+
+    while (client.state() == MQTT_CONNECTING) {
+        client.loop();
+    }
+    IS_TRUE(client.state() == MQTT_CONNECTION_TIMEOUT);
+    IS_TRUE(connect_callback_count == 1);
+    IS_TRUE(connect_callback_state == MQTT_CONNECTION_TIMEOUT);
+
+    END_IT
+}
+
+int test_reconnect() {
+    IT("reconnects from loop after losing the connection (takes 2 seconds)");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setConnectCallback(connect_callback);
+    client.setReconnect(1000,8000,0);
+    IS_TRUE(client.nextAttemptIn() == MQTT_RECONNECT_NEVER);
+
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.nextAttemptIn() == MQTT_RECONNECT_NEVER);
+
+    shimClient.setConnected(false);
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECTION_LOST);
+    // Somewhere up to the first limit
+    IS_TRUE(client.nextAttemptIn() <= 1000);
+
+    sleep(2);
+    connect_callback_count = 0;
+    shimClient.respond(connack,4);
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECTING);
+    IS_TRUE(client.nextAttemptIn() == MQTT_RECONNECT_NEVER);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.connected());
+    IS_TRUE(connect_callback_count == 1);
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_reconnect_gives_up() {
+    IT("gives up reconnecting after the attempt budget (takes 4 seconds)");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setReconnect(1000,1500,2);
+
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    shimClient.setConnected(false);
+    shimClient.setAllowConnect(false);
+    client.loop();
+    IS_TRUE(client.nextAttemptIn() <= 1000);
+
+    sleep(2);
+    client.loop();
+    IS_TRUE(client.state() == MQTT_CONNECT_FAILED);
+    // The limit has doubled, but not past the maximum
+    IS_TRUE(client.nextAttemptIn() <= 1500);
+
+    sleep(2);
+    client.loop();
+    IS_TRUE(client.state() == MQTT_CONNECT_FAILED);
+    IS_TRUE(client.nextAttemptIn() == MQTT_RECONNECT_NEVER);
+
+    // Connecting again gets a new budget
+    rc = client.connect((char*)"client_test1");
+    IS_FALSE(rc);
+    IS_TRUE(client.nextAttemptIn() <= 1000);
+
+    // Until the sketch disconnects
+    client.disconnect();
+    IS_TRUE(client.nextAttemptIn() == MQTT_RECONNECT_NEVER);
+
+    END_IT
+}
+
 int main()
 {
     SUITE("Connect");
@@ -332,5 +516,12 @@ int main()
     test_connect_disconnect_connect();
 
     test_connect_custom_keepalive();
+
+    test_connect_async();
+    test_connect_async_fails_on_bad_rc();
+    test_connect_async_fails_on_no_response();
+
+    test_reconnect();
+    test_reconnect_gives_up();
     FINISH
 }
@@ -172,9 +172,59 @@ int test_keepalive_disconnects_hung() {
     END_IT
 }
 
+int test_keepalive_next_action() {
+    IT("reports when loop next has something to do (takes 1 second)");
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.millisUntilNextAction() == MQTT_RECONNECT_NEVER);
+
+    client.setKeepAlive(2);
+    client.setRetryTimeout(1);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // The next ping
+    uint32_t next = client.millisUntilNextAction();
+    IS_TRUE(next > 1000);
+    IS_TRUE(next <= 2001);
+
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,18);
+    rc = client.publish((char*)"topic",(byte*)"payload",7,false,1);
+    IS_TRUE(rc);
+
+    // The resend comes first
+    next = client.millisUntilNextAction();
+    IS_TRUE(next <= 1000);
+
+    usleep(next*1000);
+    publish[0] = 0x3A;
+    shimClient.expect(publish,18);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(shimClient.error());
+
+    // Something to read
+    byte puback[] = {0x40,0x2,0x0,0x2};
+    shimClient.respond(puback,4);
+    IS_TRUE(client.millisUntilNextAction() == 0);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 0);
+
+    END_IT
+}
+
 int main()
 {
     SUITE("Keep-alive");
+    test_keepalive_next_action();
     test_keepalive_pings_idle();
     test_keepalive_pings_with_outbound_qos0();
     test_keepalive_pings_with_inbound_qos0();
@@ -18,6 +18,8 @@ ShimClient::ShimClient() {
     this->_error = false;
     this->expectAnything = true;
     this->_received = 0;
+    this->_writevCalls = 0;
+    this->_maxWrite = 0;
     this->_expectedPort = 0;
 }
 
@@ -72,6 +74,9 @@ size_t ShimClient::write(uint8_t b)  {
     return 1;
 }
 size_t ShimClient::write(const uint8_t *buf, size_t size)  {
+    if (this->_maxWrite > 0 && size > this->_maxWrite) {
+        size = this->_maxWrite;
+    }
     this->_received += size;
     TRACE( "[" << std::dec << (unsigned int)(size) << "] ");
     uint16_t i=0;
@@ -96,16 +101,28 @@ size_t ShimClient::write(const uint8_t *buf, size_t size)  {
     TRACE("\n"<<std::dec);
     return size;
 }
+size_t ShimClient::writev(const uint8_t* const* buffers, const size_t* lengths, uint8_t count) {
+    this->_writevCalls++;
+    size_t rc = 0;
+    for (uint8_t i=0;i<count;i++) {
+        size_t n = this->write(buffers[i],lengths[i]);
+        rc += n;
+        if (n < lengths[i]) {
+            break;
+        }
+    }
+    return rc;
+}
 int ShimClient::available()  {
-    return this->responseBuffer->available();
+    return this->responseBuffer->remaining();
 }
 int ShimClient::read()  { return this->responseBuffer->next(); }
 int ShimClient::read(uint8_t *buf, size_t size) {
     uint16_t i = 0;
-    for (;i<size;i++) {
+    for (;i<size && this->responseBuffer->available();i++) {
         buf[i] = this->read();
     }
-    return size;
+    return i;
 }
 int ShimClient::peek()  { return 0; }
 void ShimClient::flush() {}
@@ -127,6 +144,10 @@ ShimClient* ShimClient::expect(uint8_t *buf, size_t size) {
     return this;
 }
 
+void ShimClient::setMaxWrite(size_t n) {
+    this->_maxWrite = n;
+}
+
 void ShimClient::setConnected(bool b) {
     this->_connected = b;
 }
@@ -142,6 +163,10 @@ uint16_t ShimClient::received() {
     return this->_received;
 }
 
+uint16_t ShimClient::writevCalls() {
+    return this->_writevCalls;
+}
+
 void ShimClient::expectConnect(IPAddress ip, uint16_t port) {
     this->_expectedIP = ip;
     this->_expectedPort = port;
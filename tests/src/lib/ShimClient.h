@@ -3,11 +3,12 @@
 
 #include "Arduino.h"
 #include "Client.h"
+#include "ExtendedClient.h"
 #include "IPAddress.h"
 #include "Buffer.h"
 
 
-class ShimClient : public Client {
+class ShimClient : public ExtendedClient {
 private:
     Buffer* responseBuffer;
     Buffer* expectBuffer;
@@ -16,6 +17,8 @@ private:
     bool expectAnything;
     bool _error;
     uint16_t _received;
+    uint16_t _writevCalls;
+    size_t _maxWrite;
     IPAddress _expectedIP;
     uint16_t _expectedPort;
     const char* _expectedHost;
@@ -26,6 +29,7 @@ public:
   virtual int connect(const char *host, uint16_t port);
   virtual size_t write(uint8_t);
   virtual size_t write(const uint8_t *buf, size_t size);
+  virtual size_t writev(const uint8_t* const* buffers, const size_t* lengths, uint8_t count);
   virtual int available();
   virtual int read();
   virtual int read(uint8_t *buf, size_t size);
@@ -42,10 +46,13 @@ public:
   virtual void expectConnect(const char *host, uint16_t port);
   
   virtual uint16_t received();
+  virtual uint16_t writevCalls();
   virtual bool error();
   
   virtual void setAllowConnect(bool b);
   virtual void setConnected(bool b);
+  // Limit how many bytes each write takes, to test short writes. 0 for no limit
+  virtual void setMaxWrite(size_t n);
 };
 
 #endif
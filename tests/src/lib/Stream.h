@@ -4,7 +4,7 @@
 #include "Arduino.h"
 #include "Buffer.h"
 
-class Stream {
+class Stream : public Print {
 private:
     Buffer* expectBuffer;
     bool _error;
@@ -13,6 +13,7 @@ private:
 public:
     Stream();
     virtual size_t write(uint8_t);
+    using Print::write;
     
     virtual bool error();
     virtual void expect(uint8_t *buf, size_t size);
@@ -0,0 +1,407 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+#include <unistd.h>
+
+// Built with MQTT_VERSION set to MQTT_VERSION_5 - see the Makefile
+
+byte server[] = { 172, 16, 0, 2 };
+
+bool callback_called = false;
+char lastTopic[1024];
+char lastPayload[1024];
+unsigned int lastLength;
+
+void reset_callback() {
+    callback_called = false;
+    lastTopic[0] = '\0';
+    lastPayload[0] = '\0';
+    lastLength = 0;
+}
+
+void callback(char* topic, byte* payload, unsigned int length) {
+    callback_called = true;
+    strcpy(lastTopic,topic);
+    memcpy(lastPayload,payload,length);
+    lastLength = length;
+}
+
+uint32_t chunkTotalLength;
+uint32_t chunkPayloadLength;
+int chunk_end_count;
+
+void message_begin(const char* topic, uint16_t topicLength, uint32_t length) {
+    chunkTotalLength = length;
+    chunkPayloadLength = 0;
+    chunk_end_count = 0;
+}
+
+void message_chunk(byte* data, unsigned int length) {
+    chunkPayloadLength += length;
+}
+
+void message_end() {
+    chunk_end_count++;
+}
+
+int published_count = 0;
+uint8_t published_reason = 0;
+
+void publish_callback(uint16_t msgId, uint8_t reason) {
+    published_count++;
+    published_reason = reason;
+}
+
+// Receive Maximum 1, Topic Alias Maximum 2, Maximum Packet Size 64
+byte connack_limits[] = {0x20,0x0e,0x00,0x00,0x0b,0x21,0x00,0x01,0x22,0x00,0x02,0x27,0x00,0x00,0x00,0x40};
+
+int test_mqtt5_connect() {
+    IT("sends an MQTT 5 connect packet and reads the limits in the connack");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connect[] = {0x10,0x21,0x0,0x4,0x4d,0x51,0x54,0x54,0x5,0x2,0x0,0xf,0x8,0x21,0x0,0x14,0x27,0x0,0x0,0x1,0x0,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    shimClient.expect(connect,35);
+    shimClient.respond(connack_limits,16);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECTED);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_mqtt5_connect_refused() {
+    IT("leaves the reason code of a refused connect in the state");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = {0x20,0x03,0x00,0x86,0x00};
+    shimClient.respond(connack,5);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == 0x86);
+
+    END_IT
+}
+
+int test_mqtt5_topic_alias() {
+    IT("publishes with topic aliases once the topic has been sent");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    shimClient.respond(connack_limits,16);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publishA[] = {0x30,0xe,0x0,0x7,0x74,0x6f,0x70,0x69,0x63,0x2f,0x61,0x3,0x23,0x0,0x1,0x70};
+    byte aliasA[] = {0x30,0x7,0x0,0x0,0x3,0x23,0x0,0x1,0x70};
+    byte publishB[] = {0x30,0xe,0x0,0x7,0x74,0x6f,0x70,0x69,0x63,0x2f,0x62,0x3,0x23,0x0,0x2,0x70};
+    byte aliasB[] = {0x30,0x7,0x0,0x0,0x3,0x23,0x0,0x2,0x70};
+    // The server allows two aliases
+    byte publishC[] = {0x30,0xb,0x0,0x7,0x74,0x6f,0x70,0x69,0x63,0x2f,0x63,0x0,0x70};
+    shimClient.expect(publishA,16);
+    shimClient.expect(aliasA,9);
+    shimClient.expect(publishB,16);
+    shimClient.expect(aliasB,9);
+    shimClient.expect(publishC,13);
+    shimClient.expect(publishC,13);
+    shimClient.expect(aliasA,9);
+
+    IS_TRUE(client.publish("topic/a","p"));
+    IS_TRUE(client.publish("topic/a","p"));
+    IS_TRUE(client.publish(client.topic("topic/b"),"p"));
+    IS_TRUE(client.publish("topic/b","p"));
+    IS_TRUE(client.publish("topic/c","p"));
+    IS_TRUE(client.publish("topic/c","p"));
+    IS_TRUE(client.publish("topic/a","p"));
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_mqtt5_limits() {
+    IT("keeps to the receive maximum and maximum packet size of the server");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    shimClient.respond(connack_limits,16);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // Too big for the server - and the alias is not used up
+    byte payload[60];
+    memset(payload,'x',60);
+    IS_FALSE(client.publish("topic/a",payload,60));
+
+    byte publish[] = {0x32,0xd,0x0,0x7,0x74,0x6f,0x70,0x69,0x63,0x2f,0x61,0x0,0x2,0x0,0x70};
+    shimClient.expect(publish,15);
+    IS_TRUE(client.publish("topic/a","p",false,1));
+    // Only one message can be waiting to be acknowledged
+    IS_FALSE(client.publish("topic/a","p",false,1));
+    IS_TRUE(client.getInflightCount() == 1);
+
+    // Success, with a reason code of "no matching subscribers"
+    byte puback[] = {0x40,0x3,0x0,0x2,0x10};
+    shimClient.respond(puback,5);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 0);
+
+    byte publishA[] = {0x30,0xe,0x0,0x7,0x74,0x6f,0x70,0x69,0x63,0x2f,0x61,0x3,0x23,0x0,0x1,0x70};
+    shimClient.expect(publishA,16);
+    IS_TRUE(client.publish("topic/a","p"));
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_mqtt5_qos2_refused() {
+    IT("completes a qos 2 message the server refuses in its pubrec");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    byte connack[] = {0x20,0x03,0x00,0x00,0x00};
+    shimClient.respond(connack,5);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setPublishCallback(publish_callback);
+    published_count = 0;
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x34,0xb,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x0,0x70};
+    shimClient.expect(publish,13);
+    IS_TRUE(client.publish("topic","p",false,2));
+
+    // Quota exceeded - no PUBREL follows
+    byte pubrec[] = {0x50,0x3,0x0,0x2,0x97};
+    shimClient.respond(pubrec,5);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 0);
+    IS_TRUE(published_count == 1);
+    IS_TRUE(published_reason == 0x97);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_mqtt5_resend_on_reconnect() {
+    IT("only resends an unacknowledged message after reconnecting");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    byte connack[] = {0x20,0x03,0x00,0x00,0x00};
+    shimClient.respond(connack,5);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setRetryTimeout(1);
+    int rc = client.connect((char*)"client_test1",NULL,NULL,0,0,0,0,false);
+    IS_TRUE(rc);
+
+    byte publish[] = {0x32,0xb,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x0,0x70};
+    shimClient.expect(publish,13);
+    IS_TRUE(client.publish("topic","p",false,1));
+
+    // Nothing is sent when the retry timeout passes
+    sleep(2);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(shimClient.error());
+
+    // Sent again, marked as a duplicate, once the connection is made again
+    shimClient.setConnected(false);
+    byte connect[] = {0x10,0x21,0x0,0x4,0x4d,0x51,0x54,0x54,0x5,0x0,0x0,0xf,0x8,0x21,0x0,0x14,0x27,0x0,0x0,0x1,0x0,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    shimClient.expect(connect,35);
+    shimClient.respond(connack,5);
+    publish[0] |= 0x08;
+    shimClient.expect(publish,13);
+    rc = client.connect((char*)"client_test1",NULL,NULL,0,0,0,0,false);
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_mqtt5_server_keep_alive() {
+    IT("uses the server keep alive without changing the one asked for");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connect[] = {0x10,0x21,0x0,0x4,0x4d,0x51,0x54,0x54,0x5,0x2,0x0,0xf,0x8,0x21,0x0,0x14,0x27,0x0,0x0,0x1,0x0,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    // Server Keep Alive 5
+    byte connack[] = {0x20,0x06,0x00,0x00,0x03,0x13,0x00,0x05};
+    shimClient.expect(connect,35);
+    shimClient.respond(connack,8);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.millisUntilTimer() <= 5001);
+
+    // Asks for its own keep alive again
+    shimClient.setConnected(false);
+    shimClient.expect(connect,35);
+    byte plainConnack[] = {0x20,0x03,0x00,0x00,0x00};
+    shimClient.respond(plainConnack,5);
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.millisUntilTimer() > 5001);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_mqtt5_receive() {
+    IT("receives a message with properties");
+    reset_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    byte connack[] = {0x20,0x03,0x00,0x00,0x00};
+    shimClient.respond(connack,5);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // Payload format indicator
+    byte publish[] = {0x32,0x13,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x2,0x1,0x1,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,21);
+
+    byte puback[] = {0x40,0x2,0x12,0x34};
+    shimClient.expect(puback,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(lastLength == 7);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_mqtt5_receive_chunked() {
+    IT("receives a message with properties in chunks");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    byte connack[] = {0x20,0x03,0x00,0x00,0x00};
+    shimClient.respond(connack,5);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setChunkCallbacks(message_begin,message_chunk,message_end);
+    client.setBufferSize(40);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // 1 byte header, 1 byte remaining length, 7 bytes of topic, 3 of properties and 90 of payload
+    byte publish[100];
+    memset(publish,'x',100);
+    byte header[] = {0x30,0x62,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x2,0x1,0x1};
+    memcpy(publish,header,12);
+    shimClient.respond(publish,100);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(chunkTotalLength == 88);
+    IS_TRUE(chunkPayloadLength == 88);
+    IS_TRUE(chunk_end_count == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_mqtt5_subscribe() {
+    IT("subscribes and reads the reason codes in the suback");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    byte connack[] = {0x20,0x03,0x00,0x00,0x00};
+    shimClient.respond(connack,5);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte subscribe[] = {0x82,0xb,0x0,0x2,0x0,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x1};
+    shimClient.expect(subscribe,13);
+    rc = client.subscribe((char*)"topic",1);
+    IS_TRUE(rc);
+
+    byte suback[] = {0x90,0x4,0x0,0x2,0x0,0x1};
+    shimClient.respond(suback,6);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.subscribeStatus(2) == 1);
+
+    byte unsubscribe[] = {0xa2,0xa,0x0,0x3,0x0,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    shimClient.expect(unsubscribe,12);
+    rc = client.unsubscribe((char*)"topic");
+    IS_TRUE(rc);
+
+    // Not authorized
+    byte unsuback[] = {0xb0,0x4,0x0,0x3,0x0,0x87};
+    shimClient.respond(unsuback,6);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.subscribeStatus(3) == MQTT_SUBSCRIBE_FAILED);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_mqtt5_server_disconnect() {
+    IT("leaves the reason code of a disconnect from the server in the state");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+    byte connack[] = {0x20,0x03,0x00,0x00,0x00};
+    shimClient.respond(connack,5);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // Session taken over
+    byte disconnect[] = {0xe0,0x2,0x8e,0x0};
+    shimClient.respond(disconnect,4);
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_FALSE(client.connected());
+    IS_TRUE(client.state() == 0x8e);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("MQTT 5");
+    test_mqtt5_connect();
+    test_mqtt5_connect_refused();
+    test_mqtt5_topic_alias();
+    test_mqtt5_limits();
+    test_mqtt5_qos2_refused();
+    test_mqtt5_resend_on_reconnect();
+    test_mqtt5_server_keep_alive();
+    test_mqtt5_receive();
+    test_mqtt5_receive_chunked();
+    test_mqtt5_subscribe();
+    test_mqtt5_server_disconnect();
+    FINISH
+}
@@ -0,0 +1,250 @@
+#include "PubSubClient.h"
+#include "PosixClient.h"
+#include "BDDTest.h"
+#include "trace.h"
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+byte localhost[] = { 127, 0, 0, 1 };
+
+// Listens on a free port on the loopback interface, returning the socket and
+// setting port
+int listenLocal(uint16_t* port) {
+    int s = socket(AF_INET,SOCK_STREAM,0);
+    struct sockaddr_in addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    bind(s,(struct sockaddr*)&addr,sizeof(addr));
+    listen(s,1);
+    socklen_t length = sizeof(addr);
+    getsockname(s,(struct sockaddr*)&addr,&length);
+    *port = ntohs(addr.sin_port);
+    return s;
+}
+
+// Waits up to a second for n bytes from the client to arrive at sock
+int receive(int sock, uint8_t* buf, int n) {
+    int got = 0;
+    for (int i = 0; i < 100 && got < n; i++) {
+        int rc = recv(sock,buf+got,n-got,MSG_DONTWAIT);
+        if (rc > 0) {
+            got += rc;
+        } else {
+            usleep(10000);
+        }
+    }
+    return got;
+}
+
+// Waits up to a second for the server's bytes to reach the client
+void waitAvailable(PosixClient& client, int n) {
+    for (int i = 0; i < 100 && client.available() < n; i++) {
+        usleep(10000);
+    }
+}
+
+int test_posix_client_connect() {
+    IT("connects, writes and reads over a socket");
+    uint16_t port;
+    int listener = listenLocal(&port);
+
+    PosixClient client;
+    IS_FALSE(client);
+    IS_FALSE(client.connected());
+    int rc = client.connect(IPAddress(localhost),port);
+    IS_TRUE(rc);
+    IS_TRUE(client);
+    IS_TRUE(client.connected());
+    int server = accept(listener,NULL,NULL);
+    IS_TRUE(server >= 0);
+
+    IS_TRUE(client.write((const uint8_t*)"hello",5) == 5);
+    IS_TRUE(client.write('!') == 1);
+    uint8_t buf[16];
+    IS_TRUE(receive(server,buf,6) == 6);
+    IS_TRUE(memcmp(buf,"hello!",6) == 0);
+
+    const uint8_t* buffers[] = {(const uint8_t*)"gather",(const uint8_t*)"ed"};
+    size_t lengths[] = {6,2};
+    IS_TRUE(client.writev(buffers,lengths,2) == 8);
+    IS_TRUE(receive(server,buf,8) == 8);
+    IS_TRUE(memcmp(buf,"gathered",8) == 0);
+
+    IS_TRUE(client.available() == 0);
+    IS_TRUE(client.read() == -1);
+    send(server,"reply",5,0);
+    waitAvailable(client,5);
+    IS_TRUE(client.available() == 5);
+    IS_TRUE(client.peek() == 'r');
+    IS_TRUE(client.read() == 'r');
+    IS_TRUE(client.read(buf,sizeof(buf)) == 4);
+    IS_TRUE(memcmp(buf,"eply",4) == 0);
+
+    // Connected until the server closes its end and the data has been read
+    send(server,"x",1,0);
+    close(server);
+    waitAvailable(client,1);
+    IS_TRUE(client.connected());
+    IS_TRUE(client.read() == 'x');
+    IS_FALSE(client.connected());
+
+    client.stop();
+    IS_FALSE(client);
+    close(listener);
+
+    END_IT
+}
+
+int test_posix_client_connect_hostname() {
+    IT("connects to a hostname");
+    uint16_t port;
+    int listener = listenLocal(&port);
+
+    PosixClient client;
+    int rc = client.connect("localhost",port);
+    IS_TRUE(rc);
+    IS_TRUE(client.connected());
+
+    close(listener);
+    END_IT
+}
+
+int test_posix_client_connect_refused() {
+    IT("fails to connect to a closed port");
+    uint16_t port;
+    int listener = listenLocal(&port);
+    close(listener);
+
+    PosixClient client;
+    int rc = client.connect(IPAddress(localhost),port);
+    IS_FALSE(rc);
+    IS_FALSE(client);
+    IS_FALSE(client.connected());
+
+    END_IT
+}
+
+int test_posix_client_mqtt() {
+    IT("carries an MQTT connection");
+    uint16_t port;
+    int listener = listenLocal(&port);
+
+    PosixClient posixClient;
+    PubSubClient client(localhost, port, posixClient);
+    int rc = client.connectAsync((char*)"client_test1");
+    IS_TRUE(rc);
+    int server = accept(listener,NULL,NULL);
+
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x2,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    uint8_t buf[64];
+    IS_TRUE(receive(server,buf,26) == 26);
+    IS_TRUE(memcmp(buf,connect,26) == 0);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    send(server,connack,4,0);
+    for (int i = 0; i < 100 && !client.connected(); i++) {
+        usleep(10000);
+        client.loop();
+    }
+    IS_TRUE(client.connected());
+
+    // Too big to copy into the buffer, so sent after the header in the same call
+    uint8_t payload[300];
+    memset(payload,'p',sizeof(payload));
+    rc = client.publish((char*)"topic",payload,sizeof(payload));
+    IS_TRUE(rc);
+    uint8_t packet[310];
+    IS_TRUE(receive(server,packet,310) == 310);
+    IS_TRUE(packet[0] == 0x30);
+    IS_TRUE(memcmp(packet+5,"topic",5) == 0);
+    IS_TRUE(memcmp(packet+10,payload,300) == 0);
+
+    client.disconnect();
+    IS_TRUE(receive(server,buf,2) == 2);
+    IS_TRUE(buf[0] == 0xE0);
+
+    close(server);
+    close(listener);
+    END_IT
+}
+
+int callbackCount;
+
+void callback(char* topic, byte* payload, unsigned int length) {
+    callbackCount++;
+}
+
+// Waits up to a second for fd to become readable
+bool waitReadable(int fd) {
+    struct pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    return poll(&p,1,1000) == 1;
+}
+
+int test_posix_client_event_loop() {
+    IT("is driven by socket readiness");
+    uint16_t port;
+    int listener = listenLocal(&port);
+    callbackCount = 0;
+
+    PosixClient posixClient;
+    PubSubClient client(localhost, port, callback, posixClient);
+    IS_TRUE(client.getFd() == -1);
+    IS_FALSE(client.wantsRead());
+
+    int rc = client.connectAsync((char*)"client_test1");
+    IS_TRUE(rc);
+    int server = accept(listener,NULL,NULL);
+    IS_TRUE(client.getFd() >= 0);
+    IS_TRUE(client.getFd() == posixClient.fd());
+    IS_TRUE(client.wantsRead());
+    IS_FALSE(client.wantsWrite());
+    uint8_t buf[64];
+    IS_TRUE(receive(server,buf,26) == 26);
+
+    // The CONNACK and two messages arrive together
+    byte packets[] = { 0x20,0x02,0x00,0x00,
+        0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64,
+        0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64 };
+    send(server,packets,sizeof(packets),0);
+    IS_TRUE(waitReadable(client.getFd()));
+    rc = client.onReadable();
+    IS_TRUE(rc);
+    IS_TRUE(client.connected());
+    IS_TRUE(callbackCount == 2);
+
+    // Nothing to do until the keepalive
+    IS_TRUE(client.millisUntilTimer() > 1000);
+    IS_TRUE(client.millisUntilTimer() <= 15001);
+    rc = client.onTimer();
+    IS_TRUE(rc);
+    IS_FALSE(client.wantsWrite());
+    rc = client.onWritable();
+    IS_TRUE(rc);
+
+    close(server);
+    IS_TRUE(waitReadable(client.getFd()));
+    rc = client.onReadable();
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECTION_LOST);
+    IS_FALSE(client.wantsRead());
+
+    close(listener);
+    END_IT
+}
+
+int main()
+{
+    SUITE("PosixClient");
+    test_posix_client_connect();
+    test_posix_client_connect_hostname();
+    test_posix_client_connect_refused();
+    test_posix_client_mqtt();
+    test_posix_client_event_loop();
+    FINISH
+}
@@ -3,6 +3,7 @@
 #include "Buffer.h"
 #include "BDDTest.h"
 #include "trace.h"
+#include <unistd.h>
 
 
 byte server[] = { 172, 16, 0, 2 };
@@ -11,6 +12,22 @@ void callback(char* topic, byte* payload, unsigned int length) {
   // handle message arrived
 }
 
+int published_count = 0;
+uint16_t published_msgId = 0;
+uint8_t published_reason = 0;
+
+void reset_published() {
+    published_count = 0;
+    published_msgId = 0;
+    published_reason = 0;
+}
+
+void publish_callback(uint16_t msgId, uint8_t reason) {
+    published_count++;
+    published_msgId = msgId;
+    published_reason = reason;
+}
+
 int test_publish() {
     IT("publishes a null-terminated string");
     ShimClient shimClient;
@@ -61,6 +78,122 @@ int test_publish_bytes() {
     END_IT
 }
 
+int test_publish_fixed_buffer() {
+    IT("publishes from a client with a fixed size buffer");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClientT<40> client(server, 1883, callback, shimClient);
+    IS_TRUE(client.getBufferSize() == 40);
+    IS_FALSE(client.setBufferSize(80));
+    IS_TRUE(client.setBufferSize(40));
+    IS_TRUE(PubSubClientT<40>::maxTopicLength == 33);
+    IS_TRUE(PubSubClientT<40>::maxPayloadLength(5) == 26);
+    IS_TRUE(PubSubClientT<40>::maxPayloadLength(31) == 0);
+    IS_TRUE(PubSubClientT<40>::maxPayloadLength(32) == 0);
+    IS_TRUE(PubSubClientT<40>::maxPayloadLength(33) == 0);
+
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,16);
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_TRUE(rc);
+
+    // The topic has to fit in the buffer
+    rc = client.publish((char*)"a/topic/that/does/not/fit/the/buffer",(char*)"payload");
+    IS_FALSE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_caller_buffer() {
+    IT("publishes using a buffer supplied by the caller");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    uint8_t mem[64];
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setBuffer(mem,64));
+    IS_TRUE(client.getBufferSize() == 64);
+    IS_FALSE(client.setBufferSize(65));
+    IS_TRUE(client.setBufferSize(40));
+    IS_TRUE(client.getBufferSize() == 40);
+
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    // The connect packet was built in the memory given
+    IS_TRUE(memcmp(mem+MQTT_MAX_HEADER_SIZE,"\x00\x04MQTT",6) == 0);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,16);
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_TRUE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+class CountingAllocator : public MQTTAllocator {
+public:
+    int allocated;
+    int released;
+    CountingAllocator() : allocated(0), released(0) {}
+    void* allocate(size_t size) {
+        allocated++;
+        return malloc(size);
+    }
+    void release(void* ptr) {
+        released++;
+        free(ptr);
+    }
+};
+
+int test_publish_allocator() {
+    IT("allocates its buffers with the allocator it is given");
+    CountingAllocator allocator;
+    {
+        ShimClient shimClient;
+        shimClient.setAllowConnect(true);
+
+        byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+        shimClient.respond(connack,4);
+
+        PubSubClient client(server, 1883, callback, shimClient);
+        IS_TRUE(client.setOfflineQueue(64,MQTT_QUEUE_DROP_NEWEST));
+        IS_TRUE(client.setAllocator(allocator));
+        // The buffer and the offline queue are moved
+        IS_TRUE(allocator.allocated == 2);
+        IS_TRUE(client.setBufferSize(128));
+        IS_TRUE(allocator.allocated == 3);
+        IS_TRUE(allocator.released == 1);
+
+        int rc = client.connect((char*)"client_test1");
+        IS_TRUE(rc);
+
+        byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+        shimClient.expect(publish,18);
+        rc = client.publish((char*)"topic",(char*)"payload",false,1);
+        IS_TRUE(rc);
+        // The inflight table and its buffer
+        IS_TRUE(allocator.allocated == 5);
+
+        IS_FALSE(shimClient.error());
+    }
+    IS_TRUE(allocator.released == allocator.allocated);
+
+    END_IT
+}
 
 int test_publish_retained() {
     IT("publishes retained - 1");
@@ -126,7 +259,7 @@ int test_publish_not_connected() {
 }
 
 int test_publish_too_long() {
-    IT("publish fails when topic/payload are too long");
+    IT("publish fails when topic is too long");
     ShimClient shimClient;
     shimClient.setAllowConnect(true);
 
@@ -134,12 +267,12 @@ int test_publish_too_long() {
     shimClient.respond(connack,4);
 
     PubSubClient client(server, 1883, callback, shimClient);
-    client.setBufferSize(128);
+    client.setBufferSize(100);
     int rc = client.connect((char*)"client_test1");
     IS_TRUE(rc);
 
-    //                                         0        1         2         3         4         5         6         7         8         9         0         1         2
-    rc = client.publish((char*)"topic",(char*)"123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890");
+    //                           0        1         2         3         4         5         6         7         8         9         0         1         2
+    rc = client.publish((char*)"123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890",(char*)"payload");
     IS_FALSE(rc);
 
     IS_FALSE(shimClient.error());
@@ -147,6 +280,59 @@ int test_publish_too_long() {
     END_IT
 }
 
+int test_publish_larger_than_buffer() {
+    IT("publishes a payload larger than the buffer");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    // Only as a plain Client, so the payload is written separately
+    PubSubClient client(server, 1883, callback, (Client&)shimClient);
+    client.setBufferSize(128);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte payload[200];
+    memset(payload,'A',200);
+    byte publish[] = {0x30,0xcf,0x1,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    shimClient.expect(publish,10);
+    shimClient.expect(payload,200);
+
+    rc = client.publish((char*)"topic",payload,200);
+    IS_TRUE(rc);
+
+    IS_FALSE(shimClient.error());
+    IS_TRUE(shimClient.writevCalls() == 0);
+
+    END_IT
+}
+
+int test_publish_gather() {
+    IT("publishes with a single gather write");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,16);
+
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_TRUE(rc);
+
+    IS_FALSE(shimClient.error());
+    IS_TRUE(shimClient.writevCalls() == 1);
+
+    END_IT
+}
+
 int test_publish_P() {
     IT("publishes using PROGMEM");
     ShimClient shimClient;
@@ -173,19 +359,949 @@ int test_publish_P() {
     END_IT
 }
 
+int test_publish_P_short_write() {
+    IT("finishes sending a PROGMEM publish after a short write");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[109];
+    publish[0] = 0x30;
+    publish[1] = 107;
+    memcpy(publish+2,"\0\5topic",7);
+    for (int i = 0; i < 100; i++) {
+        publish[9+i] = i;
+    }
+    shimClient.expect(publish,109);
+
+    uint16_t received = shimClient.received();
+    shimClient.setMaxWrite(10);
+    rc = client.publish_P((char*)"topic",publish+9,100,false);
+    IS_TRUE(rc);
+    // The header, then 10 bytes of the first piece of the payload
+    IS_TRUE(shimClient.received() == received+19);
+
+    shimClient.setMaxWrite(0);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.received() == received+109);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_P_buffer_full() {
+    IT("refuses a PROGMEM publish, sending none of it, when the outbound buffer is full");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    uint16_t received = shimClient.received();
+
+    // The client takes a byte at a time until the outbound buffer is full
+    shimClient.setMaxWrite(1);
+    int published = 0;
+    while (published < 200 && client.publish("x","p")) {
+        published++;
+    }
+    IS_TRUE(published < 200);
+
+    byte payload[] = { 0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0a };
+    rc = client.publish_P((char*)"topic",payload,10,false);
+    IS_FALSE(rc);
+
+    shimClient.setMaxWrite(0);
+    client.flush();
+    IS_TRUE(shimClient.received() == received+published*6);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+
+
+
+int test_begin_publish_1byte() {
+    IT("begins a publish with a 1 byte remaining length");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // Remaining length is 127
+    byte publish[] = {0x30,0x7f,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    shimClient.expect(publish,9);
+
+    rc = client.beginPublish((char*)"topic",120,false);
+    IS_TRUE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_begin_publish_2byte() {
+    IT("begins a publish with a 2 byte remaining length");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // Remaining length is 207
+    byte publish[] = {0x30,0xcf,0x1,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    shimClient.expect(publish,10);
+
+    rc = client.beginPublish((char*)"topic",200,false);
+    IS_TRUE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_begin_publish_3byte() {
+    IT("begins a publish with a 3 byte remaining length");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // Remaining length is 20007
+    byte publish[] = {0x30,0xa7,0x9c,0x1,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    shimClient.expect(publish,11);
+
+    rc = client.beginPublish((char*)"topic",20000,false);
+    IS_TRUE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_begin_publish_4byte() {
+    IT("begins a publish with a 4 byte remaining length");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // Remaining length is 2097159
+    byte publish[] = {0x30,0x87,0x80,0x80,0x1,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    shimClient.expect(publish,12);
+
+    rc = client.beginPublish((char*)"topic",2097152,false);
+    IS_TRUE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_begin_publish_max() {
+    IT("begins a publish with the largest remaining length");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // Remaining length is 268435455
+    byte publish[] = {0x30,0xff,0xff,0xff,0x7f,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    shimClient.expect(publish,12);
+
+    rc = client.beginPublish((char*)"topic",268435448UL,false);
+    IS_TRUE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_begin_publish_too_long() {
+    IT("fails to begin a publish larger than the maximum remaining length");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    uint16_t received = shimClient.received();
+    rc = client.beginPublish((char*)"topic",268435449UL,false);
+    IS_FALSE(rc);
+
+    IS_FALSE(shimClient.error());
+    IS_TRUE(shimClient.received() == received);
+
+    END_IT
+}
+
+int test_publish_topic_handle() {
+    IT("publishes to a pre-encoded topic");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
 
+    TopicHandle topic = client.topic("topic");
+    IS_TRUE(topic.valid());
+    IS_TRUE(topic.length() == 7);
 
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,16);
+    shimClient.expect(publish,16);
+    rc = client.publish(topic,"payload");
+    IS_TRUE(rc);
+    rc = client.publish(topic,"payload");
+    IS_TRUE(rc);
+    // The header, topic and payload each time, in one call
+    IS_TRUE(shimClient.writevCalls() == 2);
+
+    byte retained[] = {0x31,0xc,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x1,0x2,0x3,0x0,0x5};
+    byte payload[] = { 0x01,0x02,0x03,0x0,0x05 };
+    shimClient.expect(retained,14);
+    rc = client.publish(topic,payload,5,true);
+    IS_TRUE(rc);
+
+    byte qos1[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(qos1,18);
+    rc = client.publish(topic,(const uint8_t*)"payload",7,false,1);
+    IS_TRUE(rc);
+
+    byte begin[] = {0x30,0x0e,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    shimClient.expect(begin,9);
+    rc = client.beginPublish(topic,7,false);
+    IS_TRUE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_corked() {
+    IT("holds back publishes while corked");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    rc = client.cork();
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,16);
+    shimClient.expect(publish,16);
+    shimClient.expect(publish,16);
+
+    uint16_t received = shimClient.received();
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_TRUE(rc);
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.received() == received);
+
+    // Sent by loop
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.received() == received+32);
+
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.received() == received+32);
+    client.uncork();
+    IS_TRUE(shimClient.received() == received+48);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_short_write() {
+    IT("finishes sending a publish after a short write");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, (Client&)shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,16);
+    shimClient.expect(publish,16);
+
+    uint16_t received = shimClient.received();
+    shimClient.setMaxWrite(10);
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.received() == received+10);
+
+    // The rest of the first goes before it
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.received() == received+26);
+
+    shimClient.setMaxWrite(0);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.received() == received+32);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_short_write_gather() {
+    IT("finishes sending a gathered publish after a short write");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,16);
+
+    uint16_t received = shimClient.received();
+    shimClient.setMaxWrite(4);
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_TRUE(rc);
+    // The whole header, then the first 4 bytes of the topic
+    IS_TRUE(shimClient.received() == received+6);
+
+    shimClient.setMaxWrite(0);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.received() == received+16);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_short_write_large() {
+    IT("holds the rest of a publish larger than the outbound buffer after a short write");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // Remaining length is 1007
+    byte payload[1000];
+    for (int i = 0; i < 1000; i++) {
+        payload[i] = i & 0xff;
+    }
+    byte publish[] = {0x30,0xef,0x7,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    shimClient.expect(publish,10);
+    shimClient.expect(payload,1000);
+
+    uint16_t received = shimClient.received();
+    shimClient.setMaxWrite(10);
+    rc = client.publish((char*)"topic",payload,1000);
+    IS_TRUE(rc);
+    IS_TRUE(client.connected());
+    IS_TRUE(shimClient.received() == received+20);
+
+    shimClient.setMaxWrite(0);
+    client.flush();
+    IS_TRUE(shimClient.received() == received+1010);
+    IS_TRUE(client.connected());
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_begin_publish_back_pressure() {
+    IT("returns a short count from write() when the client is not keeping up");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // Remaining length is 1507
+    byte payload[1500];
+    for (int i = 0; i < 1500; i++) {
+        payload[i] = i & 0xff;
+    }
+    byte publish[] = {0x30,0xe3,0xb,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    shimClient.expect(publish,10);
+    shimClient.expect(payload,1500);
+
+    uint16_t received = shimClient.received();
+    shimClient.setMaxWrite(10);
+    rc = client.beginPublish((char*)"topic",1500,false);
+    IS_TRUE(rc);
+
+    size_t offset = 0;
+    bool shortWrite = false;
+    while (offset < 1500) {
+        size_t chunk = (1500-offset < 100) ? 1500-offset : 100;
+        size_t n = client.write(payload+offset,chunk);
+        if (n < chunk) {
+            shortWrite = true;
+            client.flush();
+        }
+        offset += n;
+    }
+    IS_TRUE(shortWrite);
+    IS_TRUE(client.connected());
+    rc = client.endPublish();
+    IS_TRUE(rc);
+
+    shimClient.setMaxWrite(0);
+    client.flush();
+    IS_TRUE(shimClient.received() == received+1510);
+    IS_TRUE(client.connected());
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_wants_write() {
+    IT("asks to be told when it can finish a short write");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, (Client&)shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.wantsRead());
+    IS_FALSE(client.wantsWrite());
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,16);
+
+    uint16_t received = shimClient.received();
+    shimClient.setMaxWrite(10);
+    rc = client.publish((char*)"topic",(char*)"payload");
+    IS_TRUE(rc);
+    IS_TRUE(client.wantsWrite());
+    IS_TRUE(client.millisUntilNextAction() == 0);
+
+    shimClient.setMaxWrite(0);
+    rc = client.onWritable();
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.received() == received+16);
+    IS_FALSE(client.wantsWrite());
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_offline() {
+    IT("queues publishes while disconnected and sends them once connected");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.setOfflineQueue(100,MQTT_QUEUE_DROP_NEWEST);
+    IS_TRUE(rc);
+
+    rc = client.publish((char*)"topic",(char*)"1");
+    IS_TRUE(rc);
+    rc = client.publish((char*)"topic",(char*)"2",false,1);
+    IS_TRUE(rc);
+    IS_TRUE(client.getOfflineCount() == 2);
+    IS_TRUE(shimClient.received() == 0);
+
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x2,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    byte publish1[] = {0x30,0x8,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x31};
+    byte publish2[] = {0x32,0xa,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x32};
+    shimClient.expect(connect,26);
+    shimClient.expect(publish1,10);
+    shimClient.expect(publish2,12);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.getOfflineCount() == 0);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_offline_full() {
+    IT("refuses or drops publishes when the offline queue is full");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    // Room for two messages
+    int rc = client.setOfflineQueue(25,MQTT_QUEUE_DROP_NEWEST);
+    IS_TRUE(rc);
+
+    rc = client.publish((char*)"topic",(char*)"1");
+    IS_TRUE(rc);
+    rc = client.publish((char*)"topic",(char*)"2");
+    IS_TRUE(rc);
+    rc = client.publish((char*)"topic",(char*)"3");
+    IS_FALSE(rc);
+    IS_TRUE(client.getOfflineCount() == 2);
+
+    rc = client.setOfflineQueue(25,MQTT_QUEUE_DROP_OLDEST);
+    IS_TRUE(rc);
+    rc = client.publish((char*)"topic",(char*)"1");
+    IS_TRUE(rc);
+    rc = client.publish((char*)"topic",(char*)"2");
+    IS_TRUE(rc);
+    // These wrap round the end of the queue
+    rc = client.publish((char*)"topic",(char*)"3");
+    IS_TRUE(rc);
+    rc = client.publish((char*)"topic",(char*)"4");
+    IS_TRUE(rc);
+    IS_TRUE(client.getOfflineCount() == 2);
+    IS_TRUE(client.getOfflineDropped() == 2);
+
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x2,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    byte publish3[] = {0x30,0x8,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x33};
+    byte publish4[] = {0x30,0x8,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x34};
+    shimClient.expect(connect,26);
+    shimClient.expect(publish3,10);
+    shimClient.expect(publish4,10);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.getOfflineCount() == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_offline_tx_buffer() {
+    IT("refuses to queue a publish whose topic does not fit the transmit buffer");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setBufferSize(128,10));
+    int rc = client.setOfflineQueue(100,MQTT_QUEUE_DROP_NEWEST);
+    IS_TRUE(rc);
+
+    rc = client.publish((char*)"topic",(char*)"1");
+    IS_FALSE(rc);
+    rc = client.publish((char*)"t",(char*)"1");
+    IS_TRUE(rc);
+    IS_TRUE(client.getOfflineCount() == 1);
+
+    END_IT
+}
+
+int test_publish_offline_busy() {
+    IT("keeps queued publishes until the connection has room for them");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    PubSubClient client(server, 1883, callback, (Client&)shimClient);
+    int rc = client.setOfflineQueue(1000,MQTT_QUEUE_DROP_NEWEST);
+    IS_TRUE(rc);
+    char payload[201];
+    memset(payload,'x',200);
+    payload[200] = 0;
+    for (int i = 0; i < 3; i++) {
+        rc = client.publish((char*)"topic",payload);
+        IS_TRUE(rc);
+    }
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    // The first two fill the outbound buffer, so the third has to wait
+    shimClient.setMaxWrite(1);
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.getOfflineCount() == 1);
+
+    shimClient.setMaxWrite(0);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getOfflineCount() == 0);
+    IS_TRUE(client.getOfflineDropped() == 0);
+    // The CONNECT, then three publishes of 210 bytes
+    IS_TRUE(shimClient.received() == 26+3*210);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_qos1() {
+    IT("publishes qos 1 and completes on the puback");
+    reset_published();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setPublishCallback(publish_callback);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,18);
+
+    rc = client.publish((char*)"topic",(char*)"payload",false,1);
+    IS_TRUE(rc);
+    IS_TRUE(client.getLastMsgId() == 2);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    byte puback[] = { 0x40, 0x02, 0x00, 0x02 };
+    shimClient.respond(puback,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 0);
+    IS_TRUE(published_count == 1);
+    IS_TRUE(published_msgId == 2);
+    IS_TRUE(published_reason == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_qos1_store() {
+    IT("keeps qos 1 messages in a store and resends them from a new client");
+    reset_published();
+    MQTTMemoryStore store(100);
+    {
+        ShimClient shimClient;
+        shimClient.setAllowConnect(true);
+
+        byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+        shimClient.respond(connack,4);
+
+        PubSubClient client(server, 1883, callback, shimClient);
+        client.setStore(store);
+        int rc = client.connect((char*)"client_test1");
+        IS_TRUE(rc);
+
+        byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+        shimClient.expect(publish,18);
+
+        rc = client.publish((char*)"topic",(char*)"payload",false,1);
+        IS_TRUE(rc);
+        IS_TRUE(store.getUsed() == 22);
+
+        IS_FALSE(shimClient.error());
+    }
+
+    // A new client, as after a restart
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setPublishCallback(publish_callback);
+    client.setStore(store);
+
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x2,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    byte publish[] = {0x3a,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(connect,26);
+    shimClient.expect(publish,18);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    byte puback[] = { 0x40, 0x02, 0x00, 0x02 };
+    shimClient.respond(puback,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 0);
+    IS_TRUE(published_msgId == 2);
+    IS_TRUE(store.getUsed() == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_qos1_pipelined() {
+    IT("pipelines qos 1 publishes up to the inflight limit");
+    reset_published();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setPublishCallback(publish_callback);
+    int rc = client.setInflight(2,100);
+    IS_TRUE(rc);
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish1[] = {0x32,0xa,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x31};
+    byte publish2[] = {0x32,0xa,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x3,0x32};
+    shimClient.expect(publish1,12);
+    shimClient.expect(publish2,12);
+
+    rc = client.publish((char*)"topic",(char*)"1",false,1);
+    IS_TRUE(rc);
+    rc = client.publish((char*)"topic",(char*)"2",false,1);
+    IS_TRUE(rc);
+    rc = client.publish((char*)"topic",(char*)"3",false,1);
+    IS_FALSE(rc);
+    IS_TRUE(client.getInflightCount() == 2);
+
+    // Acknowledged out of order
+    byte puback[] = { 0x40, 0x02, 0x00, 0x03 };
+    shimClient.respond(puback,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 1);
+    IS_TRUE(published_msgId == 3);
+
+    byte publish3[] = {0x32,0xa,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x4,0x33};
+    shimClient.expect(publish3,12);
+    rc = client.publish((char*)"topic",(char*)"3",false,1);
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 2);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_qos1_resend_on_reconnect() {
+    IT("resends unacknowledged qos 1 publishes after reconnecting");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    rc = client.publish((char*)"topic",(char*)"payload",false,1);
+    IS_TRUE(rc);
+    shimClient.setConnected(false);
+
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x2,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    byte publish[] = {0x3a,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(connect,26);
+    shimClient.expect(publish,18);
+    shimClient.respond(connack,4);
+
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_qos2() {
+    IT("publishes qos 2 and completes on the pubcomp");
+    reset_published();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setPublishCallback(publish_callback);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x34,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,18);
+
+    rc = client.publish((char*)"topic",(char*)"payload",false,2);
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    byte pubrec[] = { 0x50, 0x02, 0x00, 0x02 };
+    shimClient.respond(pubrec,4);
+    byte pubrel[] = { 0x62, 0x02, 0x00, 0x02 };
+    shimClient.expect(pubrel,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 1);
+    IS_TRUE(published_count == 0);
+
+    // The PUBREL is resent after reconnecting, rather than the message
+    shimClient.setConnected(false);
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x2,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    shimClient.expect(connect,26);
+    shimClient.expect(pubrel,4);
+    shimClient.respond(connack,4);
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte pubcomp[] = { 0x70, 0x02, 0x00, 0x02 };
+    shimClient.respond(pubcomp,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 0);
+    IS_TRUE(published_count == 1);
+    IS_TRUE(published_msgId == 2);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_qos1_retry() {
+    IT("resends a qos 1 publish when the puback does not arrive in time");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setRetryTimeout(1);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    byte dup[] = {0x3a,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,18);
+    shimClient.expect(dup,18);
+
+    rc = client.publish((char*)"topic",(char*)"payload",false,1);
+    IS_TRUE(rc);
+
+    sleep(2);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
 
 int main()
 {
     SUITE("Publish");
     test_publish();
     test_publish_bytes();
+    test_publish_fixed_buffer();
+    test_publish_caller_buffer();
+    test_publish_allocator();
     test_publish_retained();
     test_publish_retained_2();
     test_publish_not_connected();
     test_publish_too_long();
     test_publish_P();
+    test_publish_P_short_write();
+    test_publish_P_buffer_full();
+    test_publish_larger_than_buffer();
+    test_publish_gather();
+    test_begin_publish_1byte();
+    test_begin_publish_2byte();
+    test_begin_publish_3byte();
+    test_begin_publish_4byte();
+    test_begin_publish_max();
+    test_begin_publish_too_long();
+    test_publish_topic_handle();
+    test_publish_corked();
+    test_publish_short_write();
+    test_publish_short_write_gather();
+    test_publish_short_write_large();
+    test_begin_publish_back_pressure();
+    test_publish_wants_write();
+    test_publish_offline();
+    test_publish_offline_full();
+    test_publish_offline_tx_buffer();
+    test_publish_offline_busy();
+    test_publish_qos1();
+    test_publish_qos1_store();
+    test_publish_qos1_pipelined();
+    test_publish_qos1_resend_on_reconnect();
+    test_publish_qos2();
+    test_publish_qos1_retry();
 
     FINISH
 }
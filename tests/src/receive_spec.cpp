@@ -27,6 +27,60 @@ void callback(char* topic, byte* payload, unsigned int length) {
     lastLength = length;
 }
 
+bool raw_callback_called = false;
+char lastRawTopic[1024];
+uint16_t lastRawTopicLength;
+
+void reset_raw_callback() {
+    raw_callback_called = false;
+    lastRawTopic[0] = '\0';
+    lastRawTopicLength = 0;
+}
+
+void raw_callback(const char* topic, uint16_t topicLength, byte* payload, unsigned int length) {
+    TRACE("Raw callback received topic length=" << topicLength << " length=" << length << "\n")
+    raw_callback_called = true;
+    memcpy(lastRawTopic,topic,topicLength);
+    lastRawTopicLength = topicLength;
+    memcpy(lastPayload,payload,length);
+    lastLength = length;
+}
+
+int chunk_begin_count;
+int chunk_end_count;
+int chunk_count;
+char chunkTopic[1024];
+uint16_t chunkTopicLength;
+uint32_t chunkTotalLength;
+uint8_t chunkPayload[2048];
+uint32_t chunkPayloadLength;
+
+void reset_chunk_callbacks() {
+    chunk_begin_count = 0;
+    chunk_end_count = 0;
+    chunk_count = 0;
+    chunkTopicLength = 0;
+    chunkTotalLength = 0;
+    chunkPayloadLength = 0;
+}
+
+void message_begin(const char* topic, uint16_t topicLength, uint32_t length) {
+    chunk_begin_count++;
+    memcpy(chunkTopic,topic,topicLength);
+    chunkTopicLength = topicLength;
+    chunkTotalLength = length;
+}
+
+void message_chunk(byte* data, unsigned int length) {
+    chunk_count++;
+    memcpy(chunkPayload+chunkPayloadLength,data,length);
+    chunkPayloadLength += length;
+}
+
+void message_end() {
+    chunk_end_count++;
+}
+
 int test_receive_callback() {
     IT("receives a callback message");
     reset_callback();
@@ -290,6 +344,31 @@ int test_receive_oversized_stream_message() {
     END_IT
 }
 
+int handler_a_count;
+int handler_b_count;
+int handler_c_count;
+char handlerTopic[1024];
+
+void reset_handlers() {
+    handler_a_count = 0;
+    handler_b_count = 0;
+    handler_c_count = 0;
+    handlerTopic[0] = '\0';
+}
+
+void handler_a(char* topic, byte* payload, unsigned int length) {
+    handler_a_count++;
+    strcpy(handlerTopic,topic);
+}
+
+void handler_b(char* topic, byte* payload, unsigned int length) {
+    handler_b_count++;
+}
+
+void handler_c(char* topic, byte* payload, unsigned int length) {
+    handler_c_count++;
+}
+
 int test_receive_qos1() {
     IT("receives a qos1 message");
     reset_callback();
@@ -324,6 +403,866 @@ int test_receive_qos1() {
     END_IT
 }
 
+int test_receive_qos2() {
+    IT("receives a qos2 message once");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x34,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,18);
+
+    byte pubrec[] = {0x50,0x2,0x12,0x34};
+    shimClient.expect(pubrec,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(lastLength == 7);
+
+    // The server did not see the PUBREC and sends the message again
+    reset_callback();
+    byte dup[] = {0x3c,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(dup,18);
+    shimClient.expect(pubrec,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(callback_called);
+
+    byte pubrel[] = {0x62,0x2,0x12,0x34};
+    shimClient.respond(pubrel,4);
+    byte pubcomp[] = {0x70,0x2,0x12,0x34};
+    shimClient.expect(pubcomp,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    // Once released, the id can be used for a new message
+    shimClient.respond(publish,18);
+    shimClient.expect(pubrec,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callback_called);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_qos2_full() {
+    IT("drops the connection when too many qos2 messages are waiting for their PUBREL");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x34,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x0,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    byte pubrec[] = {0x50,0x2,0x0,0x0};
+    for (uint8_t i = 1; i <= MQTT_MAX_INCOMING_QOS2; i++) {
+        publish[10] = i;
+        pubrec[3] = i;
+        shimClient.respond(publish,18);
+        shimClient.expect(pubrec,4);
+        rc = client.loop();
+        IS_TRUE(rc);
+    }
+
+    // No room to remember it, so it cannot be acknowledged
+    reset_callback();
+    publish[10] = MQTT_MAX_INCOMING_QOS2+1;
+    shimClient.respond(publish,18);
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_FALSE(callback_called);
+    IS_TRUE(client.state() == MQTT_CONNECTION_LOST);
+    IS_FALSE(client.connected());
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_qos2_full_chunked() {
+    IT("drops the connection before passing on a chunked qos2 message it has no room to remember");
+    reset_callback();
+    reset_chunk_callbacks();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setChunkCallbacks(message_begin,message_chunk,message_end);
+    client.setBufferSize(32);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // Too big for the buffer, so passed on in chunks
+    byte publish[40];
+    memset(publish,'x',40);
+    byte header[] = {0x34,0x26,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x0};
+    memcpy(publish,header,11);
+    byte pubrec[] = {0x50,0x2,0x0,0x0};
+    for (uint8_t i = 1; i <= MQTT_MAX_INCOMING_QOS2; i++) {
+        publish[10] = i;
+        pubrec[3] = i;
+        shimClient.respond(publish,40);
+        shimClient.expect(pubrec,4);
+        rc = client.loop();
+        IS_TRUE(rc);
+    }
+    IS_TRUE(chunk_begin_count == MQTT_MAX_INCOMING_QOS2);
+    IS_TRUE(chunk_end_count == MQTT_MAX_INCOMING_QOS2);
+
+    // Resent, so not passed on again
+    publish[0] = 0x3c;
+    publish[10] = 1;
+    pubrec[3] = 1;
+    shimClient.respond(publish,40);
+    shimClient.expect(pubrec,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(chunk_begin_count == MQTT_MAX_INCOMING_QOS2);
+
+    // No room to remember it, so none of it is passed on
+    publish[0] = 0x34;
+    publish[10] = MQTT_MAX_INCOMING_QOS2+1;
+    shimClient.respond(publish,40);
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(chunk_begin_count == MQTT_MAX_INCOMING_QOS2);
+    IS_TRUE(chunk_end_count == MQTT_MAX_INCOMING_QOS2);
+    IS_FALSE(callback_called);
+    IS_TRUE(client.state() == MQTT_CONNECTION_LOST);
+    IS_FALSE(client.connected());
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_handlers() {
+    IT("passes messages to the handlers of matching subscriptions");
+    reset_callback();
+    reset_handlers();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    rc = client.subscribe("a/+/c",0,handler_a);
+    IS_TRUE(rc);
+    rc = client.subscribe("a/#",0,handler_b);
+    IS_TRUE(rc);
+    rc = client.subscribe("x/y",0,handler_c);
+    IS_TRUE(rc);
+
+    byte publish1[] = {0x30,0x8,0x0,0x5,0x61,0x2f,0x62,0x2f,0x63,0x31};
+    shimClient.respond(publish1,10);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(handler_a_count == 1);
+    IS_TRUE(strcmp(handlerTopic,"a/b/c")==0);
+    IS_TRUE(handler_b_count == 1);
+    IS_TRUE(handler_c_count == 0);
+    IS_FALSE(callback_called);
+
+    // a/# also matches a
+    byte publish2[] = {0x30,0x4,0x0,0x1,0x61,0x32};
+    shimClient.respond(publish2,6);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(handler_a_count == 1);
+    IS_TRUE(handler_b_count == 2);
+    IS_FALSE(callback_called);
+
+    byte publish3[] = {0x30,0x6,0x0,0x3,0x78,0x2f,0x79,0x33};
+    shimClient.respond(publish3,8);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(handler_c_count == 1);
+    IS_FALSE(callback_called);
+
+    // Messages no handler matches go to the callback
+    byte publish4[] = {0x30,0x6,0x0,0x3,0x78,0x2f,0x7a,0x34};
+    shimClient.respond(publish4,8);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"x/z")==0);
+
+    // Unsubscribing removes the handler
+    reset_callback();
+    rc = client.unsubscribe("a/#");
+    IS_TRUE(rc);
+    shimClient.respond(publish2,6);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(handler_b_count == 2);
+    IS_TRUE(callback_called);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_handlers_system_topic() {
+    IT("does not match wildcards to system topics");
+    reset_callback();
+    reset_handlers();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    rc = client.subscribe("#",0,handler_a);
+    IS_TRUE(rc);
+    rc = client.subscribe("$SYS/#",0,handler_b);
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0x9,0x0,0x6,0x24,0x53,0x59,0x53,0x2f,0x78,0x31};
+    shimClient.respond(publish,11);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(handler_a_count == 0);
+    IS_TRUE(handler_b_count == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_handlers_not_sent() {
+    IT("keeps the handler it had when a subscribe or unsubscribe cannot be sent");
+    reset_callback();
+    reset_handlers();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    rc = client.subscribe("a/#",0,handler_a);
+    IS_TRUE(rc);
+
+    // The client takes a byte at a time until the outbound buffer is full
+    shimClient.setMaxWrite(1);
+    int published = 0;
+    while (published < 200 && client.publish("x","p")) {
+        published++;
+    }
+    IS_TRUE(published < 200);
+    rc = client.subscribe("a/#",0,handler_b);
+    IS_FALSE(rc);
+    rc = client.unsubscribe("a/#");
+    IS_FALSE(rc);
+
+    shimClient.setMaxWrite(0);
+    client.flush();
+    byte publish[] = {0x30,0x6,0x0,0x3,0x61,0x2f,0x31,0x31};
+    shimClient.respond(publish,8);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(handler_a_count == 1);
+    IS_TRUE(handler_b_count == 0);
+    IS_FALSE(callback_called);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_acks_buffer_full() {
+    IT("still sends acknowledgements when the outbound buffer is full");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    uint16_t received = shimClient.received();
+
+    // The client takes a byte at a time until the outbound buffer is full
+    shimClient.setMaxWrite(1);
+    int published = 0;
+    while (published < 200 && client.publish("x","p")) {
+        published++;
+    }
+    IS_TRUE(published < 200);
+
+    byte publish1[] = {0x34,0x9,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x1};
+    byte publish2[] = {0x34,0x9,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2};
+    byte pingreq[] = {0xc0,0x0};
+    shimClient.respond(publish1,11);
+    shimClient.respond(publish2,11);
+    shimClient.respond(pingreq,2);
+    for (int i = 0; i < 3; i++) {
+        rc = client.loop();
+        IS_TRUE(rc);
+    }
+    IS_TRUE(callback_called);
+
+    shimClient.setMaxWrite(0);
+    client.flush();
+    // Every publish, then both PUBRECs and the PINGRESP
+    IS_TRUE(shimClient.received() == received+published*6+4+4+2);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+class CountingAllocator : public MQTTAllocator {
+public:
+    int allocated;
+    int released;
+    CountingAllocator() : allocated(0), released(0) {}
+    void* allocate(size_t size) {
+        allocated++;
+        return malloc(size);
+    }
+    void release(void* ptr) {
+        released++;
+        free(ptr);
+    }
+};
+
+int test_receive_handlers_allocator() {
+    IT("keeps handlers and topic handles in memory from the allocator");
+    reset_callback();
+    reset_handlers();
+    CountingAllocator allocator;
+    {
+        ShimClient shimClient;
+        shimClient.setAllowConnect(true);
+
+        byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+        shimClient.respond(connack,4);
+
+        PubSubClient client(server, 1883, callback, shimClient);
+        int rc = client.connect((char*)"client_test1");
+        IS_TRUE(rc);
+
+        rc = client.subscribe("a/+/c",0,handler_a);
+        IS_TRUE(rc);
+        rc = client.subscribe("x/y",0,handler_c);
+        IS_TRUE(rc);
+
+        // The buffer, the subscribe results and the five trie nodes are moved
+        IS_TRUE(client.setAllocator(allocator));
+        IS_TRUE(allocator.allocated == 7);
+
+        byte publish1[] = {0x30,0x8,0x0,0x5,0x61,0x2f,0x62,0x2f,0x63,0x31};
+        shimClient.respond(publish1,10);
+        rc = client.loop();
+        IS_TRUE(rc);
+        IS_TRUE(handler_a_count == 1);
+        IS_FALSE(callback_called);
+
+        rc = client.unsubscribe("x/y");
+        IS_TRUE(rc);
+        IS_TRUE(allocator.released == 2);
+
+        {
+            TopicHandle topic = client.topic("t");
+            IS_TRUE(allocator.allocated == 8);
+        }
+        IS_TRUE(allocator.released == 3);
+
+        IS_FALSE(shimClient.error());
+    }
+    IS_TRUE(allocator.released == allocator.allocated);
+
+    END_IT
+}
+
+// Runs out of memory after a given number of allocations
+class LimitedAllocator : public CountingAllocator {
+public:
+    int limit;
+    LimitedAllocator(int limit) : limit(limit) {}
+    void* allocate(size_t size) {
+        if (allocated-released >= limit) {
+            return NULL;
+        }
+        return CountingAllocator::allocate(size);
+    }
+};
+
+int test_receive_handlers_out_of_memory() {
+    IT("leaves no trie nodes behind when a handler cannot be added");
+    reset_callback();
+    reset_handlers();
+    // The buffer, the subscribe results and three trie nodes
+    LimitedAllocator allocator(5);
+    {
+        ShimClient shimClient;
+        shimClient.setAllowConnect(true);
+
+        byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+        shimClient.respond(connack,4);
+
+        PubSubClient client(server, 1883, callback, shimClient);
+        IS_TRUE(client.setAllocator(allocator));
+        int rc = client.connect((char*)"client_test1");
+        IS_TRUE(rc);
+
+        rc = client.subscribe("a/x",0,handler_a);
+        IS_TRUE(rc);
+        IS_TRUE(allocator.allocated-allocator.released == 4);
+
+        // Room for "b" but not "c". "b" is taken out again, and "a" is kept for "a/x"
+        rc = client.subscribe("a/b/c",0,handler_b);
+        IS_FALSE(rc);
+        IS_TRUE(allocator.allocated-allocator.released == 4);
+
+        // Room for "d" but not "e"
+        rc = client.subscribe("d/e",0,handler_c);
+        IS_FALSE(rc);
+        IS_TRUE(allocator.allocated-allocator.released == 4);
+
+        byte publish[] = {0x30,0x6,0x0,0x3,0x61,0x2f,0x78,0x31};
+        shimClient.respond(publish,8);
+        rc = client.loop();
+        IS_TRUE(rc);
+        IS_TRUE(handler_a_count == 1);
+        IS_TRUE(handler_b_count == 0);
+
+        IS_FALSE(shimClient.error());
+    }
+    IS_TRUE(allocator.released == allocator.allocated);
+
+    END_IT
+}
+
+int test_receive_qos2_allocator() {
+    IT("only allocates room for qos2 message ids once one arrives");
+    reset_callback();
+    CountingAllocator allocator;
+    CountingAllocator moved;
+    {
+        ShimClient shimClient;
+        shimClient.setAllowConnect(true);
+
+        byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+        shimClient.respond(connack,4);
+
+        PubSubClient client(server, 1883, callback, shimClient);
+        IS_TRUE(client.setAllocator(allocator));
+        IS_TRUE(allocator.allocated == 1);
+        int rc = client.connect((char*)"client_test1");
+        IS_TRUE(rc);
+
+        byte publish1[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+        shimClient.respond(publish1,18);
+        byte puback[] = {0x40,0x2,0x12,0x34};
+        shimClient.expect(puback,4);
+        rc = client.loop();
+        IS_TRUE(rc);
+        IS_TRUE(callback_called);
+        IS_TRUE(allocator.allocated == 1);
+
+        reset_callback();
+        byte publish2[] = {0x34,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x35,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+        shimClient.respond(publish2,18);
+        byte pubrec[] = {0x50,0x2,0x12,0x35};
+        shimClient.expect(pubrec,4);
+        rc = client.loop();
+        IS_TRUE(rc);
+        IS_TRUE(callback_called);
+        IS_TRUE(allocator.allocated == 2);
+
+        // The ids are moved with everything else
+        IS_TRUE(client.setAllocator(moved));
+        IS_TRUE(moved.allocated == 2);
+        IS_TRUE(allocator.released == 2);
+
+        // Still remembered, so a resend is not delivered again
+        reset_callback();
+        publish2[0] = 0x3c;
+        shimClient.respond(publish2,18);
+        shimClient.expect(pubrec,4);
+        rc = client.loop();
+        IS_TRUE(rc);
+        IS_FALSE(callback_called);
+
+        IS_FALSE(shimClient.error());
+    }
+    IS_TRUE(moved.released == moved.allocated);
+
+    END_IT
+}
+
+int test_receive_qos2_out_of_memory() {
+    IT("drops the connection when there is no memory to remember a qos2 message");
+    reset_callback();
+    // Only the buffer
+    LimitedAllocator allocator(1);
+    {
+        ShimClient shimClient;
+        shimClient.setAllowConnect(true);
+
+        byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+        shimClient.respond(connack,4);
+
+        PubSubClient client(server, 1883, callback, shimClient);
+        IS_TRUE(client.setAllocator(allocator));
+        int rc = client.connect((char*)"client_test1");
+        IS_TRUE(rc);
+
+        byte publish[] = {0x34,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+        shimClient.respond(publish,18);
+        rc = client.loop();
+        IS_FALSE(rc);
+        IS_FALSE(callback_called);
+        IS_FALSE(client.connected());
+    }
+    IS_TRUE(allocator.released == allocator.allocated);
+
+    END_IT
+}
+
+int test_receive_large_message() {
+    IT("receives a message with a multi-byte remaining length");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setBufferSize(512);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    int length = 300; // 1 byte header, 2 byte remaining length, 297 bytes of topic and payload
+    byte publish[] = {0x30,0xA9,0x02,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    byte bigPublish[length];
+    memset(bigPublish,'A',length);
+    memcpy(bigPublish,publish,10);
+    shimClient.respond(bigPublish,length);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(lastLength == length-10);
+    IS_TRUE(memcmp(lastPayload,bigPublish+10,lastLength)==0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_fragmented_message() {
+    IT("receives a message that arrives in several pieces");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+
+    // Only the fixed header has arrived
+    shimClient.respond(publish,1);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(callback_called);
+
+    // Part way through the topic
+    shimClient.respond(publish+1,5);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(callback_called);
+
+    // Part way through the payload
+    shimClient.respond(publish+6,6);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(callback_called);
+
+    shimClient.respond(publish+12,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(lastLength == 7);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_raw_callback() {
+    IT("receives a raw callback message");
+    reset_callback();
+    reset_raw_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, shimClient);
+    client.setRawCallback(raw_callback);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,18);
+
+    byte puback[] = {0x40,0x2,0x12,0x34};
+    shimClient.expect(puback,4);
+
+    rc = client.loop();
+
+    IS_TRUE(rc);
+
+    IS_FALSE(callback_called);
+    IS_TRUE(raw_callback_called);
+    IS_TRUE(lastRawTopicLength == 5);
+    IS_TRUE(memcmp(lastRawTopic,"topic",5)==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(lastLength == 7);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_raw_and_callback() {
+    IT("receives a message with both callbacks set");
+    reset_callback();
+    reset_raw_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setRawCallback(raw_callback);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,16);
+
+    rc = client.loop();
+
+    IS_TRUE(rc);
+
+    IS_TRUE(raw_callback_called);
+    IS_TRUE(lastRawTopicLength == 5);
+    IS_TRUE(memcmp(lastRawTopic,"topic",5)==0);
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(lastLength == 7);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_chunked() {
+    IT("receives a message larger than the buffer in chunks");
+    reset_callback();
+    reset_chunk_callbacks();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setChunkCallbacks(message_begin,message_chunk,message_end);
+    client.setBufferSize(64);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    int length = 300; // 1 byte header, 2 byte remaining length, 297 bytes of topic and payload
+    byte publish[] = {0x32,0xA9,0x02,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34};
+    byte bigPublish[length];
+    for (int i=0;i<length;i++) {
+        bigPublish[i] = i&0xFF;
+    }
+    memcpy(bigPublish,publish,12);
+
+    byte puback[] = {0x40,0x2,0x12,0x34};
+    shimClient.expect(puback,4);
+
+    // Arrives in two pieces, split part way through the payload
+    shimClient.respond(bigPublish,100);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(chunk_begin_count == 1);
+    IS_TRUE(chunkTopicLength == 5);
+    IS_TRUE(memcmp(chunkTopic,"topic",5)==0);
+    IS_TRUE(chunkTotalLength == length-12);
+    IS_TRUE(chunkPayloadLength == 100-12);
+    IS_TRUE(chunk_end_count == 0);
+
+    shimClient.respond(bigPublish+100,length-100);
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    IS_TRUE(chunk_begin_count == 1);
+    IS_TRUE(chunk_count > 1);
+    IS_TRUE(chunk_end_count == 1);
+    IS_TRUE(chunkPayloadLength == length-12);
+    IS_TRUE(memcmp(chunkPayload,bigPublish+12,length-12)==0);
+    IS_FALSE(callback_called);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_chunked_small_message() {
+    IT("receives a message that fits the buffer without chunks");
+    reset_callback();
+    reset_chunk_callbacks();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setChunkCallbacks(message_begin,message_chunk,message_end);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,16);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(lastLength == 7);
+    IS_TRUE(chunk_begin_count == 0);
+    IS_TRUE(chunk_count == 0);
+    IS_TRUE(chunk_end_count == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+PubSubClient* republishClient;
+
+void republish_callback(char* topic, byte* payload, unsigned int length) {
+    // Published before the message is looked at, which only works if it is
+    // built somewhere else
+    republishClient->publish("out",payload,length);
+    callback(topic,payload,length);
+}
+
+int test_receive_republish() {
+    IT("publishes from the callback using the received payload");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, republish_callback, shimClient);
+    republishClient = &client;
+    IS_TRUE(client.setBufferSize(128,64));
+    IS_TRUE(client.getBufferSize() == 128);
+    IS_TRUE(client.getTxBufferSize() == 64);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,18);
+
+    byte republished[] = {0x30,0xc,0x0,0x3,0x6f,0x75,0x74,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(republished,14);
+    byte puback[] = {0x40,0x2,0x12,0x34};
+    shimClient.expect(puback,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(lastLength == 7);
+
+    IS_FALSE(shimClient.error());
+
+    // Sharing one buffer again
+    IS_TRUE(client.setBufferSize(128,0));
+    IS_TRUE(client.getTxBufferSize() == 128);
+
+    END_IT
+}
+
 int main()
 {
     SUITE("Receive");
@@ -335,6 +1274,24 @@ int main()
     test_resize_buffer();
     test_receive_oversized_stream_message();
     test_receive_qos1();
+    test_receive_qos2();
+    test_receive_qos2_full();
+    test_receive_qos2_full_chunked();
+    test_receive_handlers();
+    test_receive_handlers_system_topic();
+    test_receive_handlers_not_sent();
+    test_receive_acks_buffer_full();
+    test_receive_handlers_allocator();
+    test_receive_handlers_out_of_memory();
+    test_receive_qos2_allocator();
+    test_receive_qos2_out_of_memory();
+    test_receive_large_message();
+    test_receive_fragmented_message();
+    test_receive_raw_callback();
+    test_receive_raw_and_callback();
+    test_receive_chunked();
+    test_receive_chunked_small_message();
+    test_receive_republish();
 
     FINISH
 }
@@ -0,0 +1,207 @@
+#include "MQTTFileStore.h"
+#include "BDDTest.h"
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define STORE_PATH "/tmp/pubsubclient_store_spec.log"
+
+byte packet1[] = {0x32,0x8,0x0,0x1,0x61,0x0,0x1,0x70,0x31,0x32};
+byte packet2[] = {0x34,0x8,0x0,0x1,0x61,0x0,0x2,0x70,0x31,0x32};
+byte pubrel2[] = {0x62,0x2,0x0,0x2};
+
+int test_store_memory() {
+    IT("keeps packets in order and replaces them by message id");
+    MQTTMemoryStore store(40);
+    uint16_t msgId;
+    uint16_t length;
+
+    IS_TRUE(store.put(1,packet1,10));
+    IS_TRUE(store.put(2,packet2,10));
+    IS_TRUE(store.getUsed() == 28);
+    // No room
+    IS_FALSE(store.put(3,packet1,10));
+
+    IS_TRUE(store.put(2,pubrel2,4));
+    IS_TRUE(store.getUsed() == 22);
+    uint8_t* packet = store.get(2,&length);
+    IS_TRUE(packet != NULL);
+    IS_TRUE(length == 4);
+    IS_TRUE(memcmp(packet,pubrel2,4) == 0);
+
+    IS_TRUE(store.remove(1));
+    IS_FALSE(store.remove(1));
+    IS_TRUE(store.get(1,&length) == NULL);
+    packet = store.item(0,&msgId,&length);
+    IS_TRUE(packet != NULL);
+    IS_TRUE(msgId == 2);
+    IS_TRUE(store.item(1,&msgId,&length) == NULL);
+
+    END_IT
+}
+
+int test_store_file_reload() {
+    IT("reloads the packets left in the log");
+    unlink(STORE_PATH);
+    uint16_t msgId;
+    uint16_t length;
+    {
+        MQTTFileStore store(STORE_PATH,100);
+        IS_TRUE(store.begin());
+        IS_TRUE(store.put(1,packet1,10));
+        IS_TRUE(store.put(2,packet2,10));
+        IS_TRUE(store.put(2,pubrel2,4));
+        IS_TRUE(store.remove(1));
+        IS_TRUE(store.getLogSize() == 15+15+9+5);
+    }
+
+    MQTTFileStore store(STORE_PATH,100);
+    IS_TRUE(store.begin());
+    uint8_t* packet = store.item(0,&msgId,&length);
+    IS_TRUE(packet != NULL);
+    IS_TRUE(msgId == 2);
+    IS_TRUE(length == 4);
+    IS_TRUE(memcmp(packet,pubrel2,4) == 0);
+    IS_TRUE(store.item(1,&msgId,&length) == NULL);
+    // Rewritten with only what is still stored
+    IS_TRUE(store.getLogSize() == 9);
+
+    END_IT
+}
+
+int test_store_file_empty() {
+    IT("empties the log once everything has been removed");
+    unlink(STORE_PATH);
+    MQTTFileStore store(STORE_PATH,100);
+    IS_TRUE(store.begin());
+    IS_TRUE(store.put(1,packet1,10));
+    IS_TRUE(store.put(2,packet2,10));
+    IS_TRUE(store.remove(1));
+    IS_TRUE(store.getLogSize() == 35);
+    IS_TRUE(store.remove(2));
+    IS_TRUE(store.getLogSize() == 0);
+
+    IS_TRUE(store.put(3,packet1,10));
+    IS_TRUE(store.getLogSize() == 15);
+
+    END_IT
+}
+
+int test_store_file_compact() {
+    IT("compacts the log as acknowledged packets build up");
+    unlink(STORE_PATH);
+    uint16_t msgId;
+    uint16_t length;
+    {
+        MQTTFileStore store(STORE_PATH,30);
+        IS_TRUE(store.begin());
+        IS_TRUE(store.put(1,packet1,10));
+        for (uint16_t i = 2; i < 20; i++) {
+            IS_TRUE(store.put(i,packet2,10));
+            IS_TRUE(store.remove(i));
+            IS_TRUE(store.getLogSize() <= 60);
+        }
+    }
+
+    MQTTFileStore store(STORE_PATH,30);
+    IS_TRUE(store.begin());
+    uint8_t* packet = store.item(0,&msgId,&length);
+    IS_TRUE(packet != NULL);
+    IS_TRUE(msgId == 1);
+    IS_TRUE(memcmp(packet,packet1,10) == 0);
+    IS_TRUE(store.item(1,&msgId,&length) == NULL);
+
+    END_IT
+}
+
+int test_store_file_truncated() {
+    IT("ignores an entry cut short by a crash");
+    unlink(STORE_PATH);
+    uint16_t msgId;
+    uint16_t length;
+    {
+        MQTTFileStore store(STORE_PATH,100);
+        IS_TRUE(store.begin());
+        IS_TRUE(store.put(1,packet1,10));
+    }
+    FILE* f = fopen(STORE_PATH,"ab");
+    byte partial[] = {'P',0x0,0x2,0x0,0xa,0x34,0x8};
+    fwrite(partial,1,7,f);
+    fclose(f);
+
+    MQTTFileStore store(STORE_PATH,100);
+    IS_TRUE(store.begin());
+    IS_TRUE(store.item(0,&msgId,&length) != NULL);
+    IS_TRUE(msgId == 1);
+    IS_TRUE(store.item(1,&msgId,&length) == NULL);
+    IS_TRUE(store.getLogSize() == 15);
+    IS_TRUE(store.put(2,packet2,10));
+    IS_TRUE(store.getLogSize() == 30);
+
+    unlink(STORE_PATH);
+
+    END_IT
+}
+
+int test_store_file_write_fails() {
+    IT("does not change a packet the log refused");
+    unlink(STORE_PATH);
+    uint16_t length;
+    MQTTFileStore store(STORE_PATH,100);
+    IS_TRUE(store.begin());
+    IS_TRUE(store.put(1,packet1,10));
+
+    // Stop the log growing any further
+    struct rlimit limit;
+    getrlimit(RLIMIT_FSIZE,&limit);
+    struct rlimit full = limit;
+    full.rlim_cur = store.getLogSize();
+    signal(SIGXFSZ,SIG_IGN);
+    setrlimit(RLIMIT_FSIZE,&full);
+    boolean rc = store.put(2,packet2,10);
+    setrlimit(RLIMIT_FSIZE,&limit);
+    signal(SIGXFSZ,SIG_DFL);
+
+    IS_FALSE(rc);
+    IS_TRUE(store.get(2,&length) == NULL);
+    IS_TRUE(store.getUsed() == 14);
+    IS_TRUE(store.getLogSize() == 15);
+
+    // A packet that cannot replace the one stored leaves it in place
+    signal(SIGXFSZ,SIG_IGN);
+    setrlimit(RLIMIT_FSIZE,&full);
+    rc = store.put(1,packet2,10);
+    setrlimit(RLIMIT_FSIZE,&limit);
+    signal(SIGXFSZ,SIG_DFL);
+
+    IS_FALSE(rc);
+    uint8_t* packet = store.get(1,&length);
+    IS_TRUE(packet != NULL && length == 10 && memcmp(packet,packet1,10) == 0);
+    IS_TRUE(store.getLogSize() == 15);
+
+    IS_TRUE(store.put(2,packet2,10));
+    IS_TRUE(store.getLogSize() == 30);
+
+    // The log agrees with what was kept in memory
+    MQTTFileStore reloaded(STORE_PATH,100);
+    IS_TRUE(reloaded.begin());
+    packet = reloaded.get(1,&length);
+    IS_TRUE(packet != NULL && length == 10 && memcmp(packet,packet1,10) == 0);
+
+    unlink(STORE_PATH);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Store");
+    test_store_memory();
+    test_store_file_reload();
+    test_store_file_empty();
+    test_store_file_compact();
+    test_store_file_truncated();
+    test_store_file_write_fails();
+    FINISH
+}
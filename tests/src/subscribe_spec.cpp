@@ -11,6 +11,33 @@ void callback(char* topic, byte* payload, unsigned int length) {
   // handle message arrived
 }
 
+int suback_count = 0;
+uint16_t suback_msgId = 0;
+uint8_t suback_results[16];
+uint16_t suback_results_count = 0;
+int unsuback_count = 0;
+uint16_t unsuback_msgId = 0;
+
+void reset_acks() {
+    suback_count = 0;
+    suback_msgId = 0;
+    suback_results_count = 0;
+    unsuback_count = 0;
+    unsuback_msgId = 0;
+}
+
+void subscribe_callback(uint16_t msgId, const uint8_t* results, uint16_t count) {
+    suback_count++;
+    suback_msgId = msgId;
+    memcpy(suback_results,results,count);
+    suback_results_count = count;
+}
+
+void unsubscribe_callback(uint16_t msgId) {
+    unsuback_count++;
+    unsuback_msgId = msgId;
+}
+
 int test_subscribe_no_qos() {
     IT("subscribe without qos defaults to 0");
     ShimClient shimClient;
@@ -75,6 +102,31 @@ int test_subscribe_not_connected() {
     END_IT
 }
 
+int test_subscribe_qos_2() {
+    IT("subscribes qos 2");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte subscribe[] = { 0x82,0xa,0x0,0x2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x2 };
+    shimClient.expect(subscribe,12);
+    byte suback[] = { 0x90,0x3,0x0,0x2,0x2 };
+    shimClient.respond(suback,5);
+
+    rc = client.subscribe((char*)"topic",2);
+    IS_TRUE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
 int test_subscribe_invalid_qos() {
     IT("subscribe fails with invalid qos values");
     ShimClient shimClient;
@@ -87,7 +139,7 @@ int test_subscribe_invalid_qos() {
     int rc = client.connect((char*)"client_test1");
     IS_TRUE(rc);
 
-    rc = client.subscribe((char*)"topic",2);
+    rc = client.subscribe((char*)"topic",3);
     IS_FALSE(rc);
     rc = client.subscribe((char*)"topic",254);
     IS_FALSE(rc);
@@ -124,6 +176,221 @@ int test_subscribe_too_long() {
     END_IT
 }
 
+int test_subscribe_many() {
+    IT("subscribes to several topics in one packet");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    const char* topics[] = { "topic1", "topic2", "topic3" };
+    uint8_t qos[] = { 0, 1, 2 };
+    byte subscribe[] = { 0x82,0x1d,0x0,0x2,
+        0x0,0x6,0x74,0x6f,0x70,0x69,0x63,0x31,0x0,
+        0x0,0x6,0x74,0x6f,0x70,0x69,0x63,0x32,0x1,
+        0x0,0x6,0x74,0x6f,0x70,0x69,0x63,0x33,0x2 };
+    shimClient.expect(subscribe,31);
+
+    rc = client.subscribe(topics,qos,3);
+    IS_TRUE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_subscribe_many_split() {
+    IT("splits a subscribe to several topics across packets to fit the buffer");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setBufferSize(30);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    const char* topics[] = { "topic1", "topic2", "topic3" };
+    uint8_t qos[] = { 0, 1, 2 };
+    byte subscribe1[] = { 0x82,0x14,0x0,0x2,
+        0x0,0x6,0x74,0x6f,0x70,0x69,0x63,0x31,0x0,
+        0x0,0x6,0x74,0x6f,0x70,0x69,0x63,0x32,0x1 };
+    byte subscribe2[] = { 0x82,0xb,0x0,0x3,
+        0x0,0x6,0x74,0x6f,0x70,0x69,0x63,0x33,0x2 };
+    shimClient.expect(subscribe1,22);
+    shimClient.expect(subscribe2,13);
+
+    rc = client.subscribe(topics,qos,3);
+    IS_TRUE(rc);
+
+    // A topic that cannot fit in a packet on its own fails the whole call
+    uint16_t received = shimClient.received();
+    const char* tooLong[] = { "topic1", "123456789012345678901234567890" };
+    rc = client.subscribe(tooLong,qos,2);
+    IS_FALSE(rc);
+    IS_TRUE(shimClient.received() == received);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_subscribe_suback() {
+    IT("reports the granted qos from the suback");
+    reset_acks();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setSubscribeCallback(subscribe_callback);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    const char* topics[] = { "topic1", "topic2", "topic3" };
+    uint8_t qos[] = { 0, 1, 2 };
+    rc = client.subscribe(topics,qos,3);
+    IS_TRUE(rc);
+    uint16_t msgId = client.getLastMsgId();
+    IS_TRUE(msgId == 2);
+    IS_TRUE(client.subscribeStatus(msgId) == MQTT_SUBSCRIBE_PENDING);
+
+    rc = client.subscribe((char*)"topic4",1);
+    IS_TRUE(rc);
+    IS_TRUE(client.getLastMsgId() == 3);
+
+    // The server refuses topic2
+    byte suback[] = { 0x90,0x5,0x0,0x2,0x0,0x80,0x1 };
+    shimClient.respond(suback,7);
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    IS_TRUE(suback_count == 1);
+    IS_TRUE(suback_msgId == 2);
+    IS_TRUE(suback_results_count == 3);
+    IS_TRUE(suback_results[0] == 0);
+    IS_TRUE(suback_results[1] == 0x80);
+    IS_TRUE(suback_results[2] == 1);
+    IS_TRUE(client.subscribeStatus(2) == MQTT_SUBSCRIBE_FAILED);
+    IS_TRUE(client.subscribeStatus(3) == MQTT_SUBSCRIBE_PENDING);
+
+    byte suback2[] = { 0x90,0x3,0x0,0x3,0x1 };
+    shimClient.respond(suback2,5);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(suback_count == 2);
+    IS_TRUE(client.subscribeStatus(3) == 1);
+    IS_TRUE(client.subscribeStatus(4) == MQTT_SUBSCRIBE_UNKNOWN);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+// Counts what it hands out, and runs out after a given number of allocations
+class LimitedAllocator : public MQTTAllocator {
+public:
+    int allocated;
+    int released;
+    int limit;
+    LimitedAllocator(int limit) : allocated(0), released(0), limit(limit) {}
+    void* allocate(size_t size) {
+        if (allocated-released >= limit) {
+            return NULL;
+        }
+        allocated++;
+        return malloc(size);
+    }
+    void release(void* ptr) {
+        released++;
+        free(ptr);
+    }
+};
+
+int test_subscribe_status_allocator() {
+    IT("only allocates room for subscribe results once one is sent");
+    LimitedAllocator allocator(10);
+    LimitedAllocator moved(10);
+    {
+        ShimClient shimClient;
+        shimClient.setAllowConnect(true);
+
+        byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+        shimClient.respond(connack,4);
+
+        PubSubClient client(server, 1883, callback, shimClient);
+        IS_TRUE(client.setAllocator(allocator));
+        IS_TRUE(allocator.allocated == 1);
+        int rc = client.connect((char*)"client_test1");
+        IS_TRUE(rc);
+        IS_TRUE(allocator.allocated == 1);
+
+        rc = client.subscribe((char*)"topic");
+        IS_TRUE(rc);
+        IS_TRUE(allocator.allocated == 2);
+        IS_TRUE(client.subscribeStatus(2) == MQTT_SUBSCRIBE_PENDING);
+
+        // The results are moved with everything else
+        IS_TRUE(client.setAllocator(moved));
+        IS_TRUE(moved.allocated == 2);
+        IS_TRUE(allocator.released == 2);
+
+        byte suback[] = { 0x90,0x3,0x0,0x2,0x0 };
+        shimClient.respond(suback,5);
+        rc = client.loop();
+        IS_TRUE(rc);
+        IS_TRUE(client.subscribeStatus(2) == 0);
+
+        IS_FALSE(shimClient.error());
+    }
+    IS_TRUE(moved.released == moved.allocated);
+
+    END_IT
+}
+
+int test_subscribe_status_out_of_memory() {
+    IT("subscribes without keeping the result when there is no memory for it");
+    // Only the buffer
+    LimitedAllocator allocator(1);
+    {
+        ShimClient shimClient;
+        shimClient.setAllowConnect(true);
+
+        byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+        shimClient.respond(connack,4);
+
+        PubSubClient client(server, 1883, callback, shimClient);
+        IS_TRUE(client.setAllocator(allocator));
+        int rc = client.connect((char*)"client_test1");
+        IS_TRUE(rc);
+
+        byte subscribe[] = { 0x82,0xa,0x0,0x2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0 };
+        shimClient.expect(subscribe,12);
+        rc = client.subscribe((char*)"topic");
+        IS_TRUE(rc);
+        IS_TRUE(client.getLastMsgId() == 2);
+        IS_TRUE(client.subscribeStatus(2) == MQTT_SUBSCRIBE_UNKNOWN);
+
+        byte suback[] = { 0x90,0x3,0x0,0x2,0x0 };
+        shimClient.respond(suback,5);
+        rc = client.loop();
+        IS_TRUE(rc);
+
+        IS_FALSE(shimClient.error());
+    }
+    IS_TRUE(allocator.released == allocator.allocated);
+
+    END_IT
+}
 
 int test_unsubscribe() {
     IT("unsubscribes");
@@ -164,15 +431,81 @@ int test_unsubscribe_not_connected() {
     END_IT
 }
 
+int test_unsubscribe_many() {
+    IT("unsubscribes from several topics in one packet");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    const char* topics[] = { "topic1", "topic2" };
+    byte unsubscribe[] = { 0xA2,0x12,0x0,0x2,
+        0x0,0x6,0x74,0x6f,0x70,0x69,0x63,0x31,
+        0x0,0x6,0x74,0x6f,0x70,0x69,0x63,0x32 };
+    shimClient.expect(unsubscribe,20);
+
+    rc = client.unsubscribe(topics,2);
+    IS_TRUE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_unsubscribe_unsuback() {
+    IT("reports the unsuback");
+    reset_acks();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setUnsubscribeCallback(unsubscribe_callback);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    rc = client.unsubscribe((char*)"topic");
+    IS_TRUE(rc);
+    IS_TRUE(client.subscribeStatus(2) == MQTT_SUBSCRIBE_PENDING);
+
+    byte unsuback[] = { 0xB0,0x2,0x0,0x2 };
+    shimClient.respond(unsuback,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    IS_TRUE(unsuback_count == 1);
+    IS_TRUE(unsuback_msgId == 2);
+    IS_TRUE(client.subscribeStatus(2) == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
 int main()
 {
     SUITE("Subscribe");
     test_subscribe_no_qos();
     test_subscribe_qos_1();
+    test_subscribe_qos_2();
     test_subscribe_not_connected();
     test_subscribe_invalid_qos();
     test_subscribe_too_long();
+    test_subscribe_many();
+    test_subscribe_many_split();
+    test_subscribe_suback();
+    test_subscribe_status_allocator();
+    test_subscribe_status_out_of_memory();
     test_unsubscribe();
     test_unsubscribe_not_connected();
+    test_unsubscribe_many();
+    test_unsubscribe_unsuback();
     FINISH
 }